@@ -5,14 +5,10 @@
  */
 
 #include "enc28j60.h"
+#include <string.h>
 #include <utils/time.h>
 #include <utils/timer.h>
-
-#ifdef ENC28J60_DEBUG
-#define ENC28J60_DEBUG_OUT(format, ...) printf("%s:%d: ENC28J60: " format, __FILE__, __LINE__, ##__VA_ARGS__)
-#else
-#define ENC28J60_DEBUG_OUT(format, ...)
-#endif
+#include "enc28j60_debug.h"
 
 #define EIE   0x1b
 #define EIR   0x1c
@@ -23,16 +19,42 @@
 #define ESTAT_CLKRDY 0x01
 #define ESTAT_TXABRT 0x02
 
+#define ECON1_RXRST  0x40
+#define ECON1_DMAST  0x20
+#define ECON1_CSUMEN 0x10
 #define ECON1_RXEN   0x04
 #define ECON1_TXRTS  0x08
 
 #define ECON2_AUTOINC 0x80
 #define ECON2_PKTDEC  0x40
 
+#define EIE_INTIE     0x80
+#define EIE_PKTIE     0x40
+#define EIE_LINKIE    0x10
+#define EIE_TXIE      0x08
+#define EIE_TXERIE    0x02
+#define EIE_RXERIE    0x01
+
+/* EIR flags sit at the same bits as their EIE enables */
+#define EIR_PKTIF     0x40
+#define EIR_LINKIF    0x10
 #define EIR_TXIF      0x08
+#define EIR_TXERIF    0x02
+#define EIR_RXERIF    0x01
+
+/* Transmit status vector, TSV<55:0> */
+#define TSV_LENGTH ENC28J60_TSV_LENGTH
+#define TSV2_COLLISION_COUNT    0x0f
+#define TSV3_PACKET_DEFER       0x04
+#define TSV3_EXCESSIVE_DEFER    0x08
+#define TSV3_EXCESSIVE_COLLISION 0x10
+#define TSV3_LATE_COLLISION     0x20
 
 #define ERXTX_BANK 0x00
 
+/* Forces the next _ENC28J60_setRegBank to write ECON1 */
+#define BANK_UNKNOWN 0xff
+
 #define ERDPTL 0x00
 #define ERDPTH 0x01
 #define EWRPTL 0x02
@@ -47,11 +69,47 @@
 #define ERXNDH 0x0b
 #define ERXRDPTL 0x0c
 #define ERXRDPTH 0x0d
+#define ERXWRPTL 0x0e
+#define ERXWRPTH 0x0f
+#define EDMASTL  0x10
+#define EDMASTH  0x11
+#define EDMANDL  0x12
+#define EDMANDH  0x13
+#define EDMADSTL 0x14
+#define EDMADSTH 0x15
 
 #define RX_BUF_START 0x0000
-#define RX_BUF_END   0x0fff
+#define RX_BUF_END   ENC28J60_RX_BUF_END
+#define RX_BUF_SIZE  (RX_BUF_END - RX_BUF_START + 1)
+
+/* Every packet in the receive buffer starts with this much */
+#define RX_HEADER_LENGTH 6
+
+/* Retained frames live at the top of chip memory. Each one is stored
+   with its control byte and room for the status vector the chip writes
+   after it, and starts at an even address. */
+#define TX_STORE_END   0x2000
+#define TX_STORE_START (TX_STORE_END - ENC28J60_TX_STORE_SIZE)
+#define TX_STORE_FOOTPRINT(length) ((1 + (length) + TSV_LENGTH + 1) & ~1)
+
+/* Each transmit slot holds the control byte, a full frame and the status
+   vector. The second one is kept for ENC28J60_sendAt. Both sit right
+   below the store. */
+#define TX_SLOT_SIZE 0x0600
+#define TX_BUF_START (TX_STORE_START - 2 * TX_SLOT_SIZE)
+#define TX_SCHEDULED_START (TX_BUF_START + TX_SLOT_SIZE)
+
+#if (ENC28J60_TX_STORE_SIZE & 1) != 0 || ENC28J60_TX_STORE_SIZE > TX_STORE_END - 2 * TX_SLOT_SIZE
+#  error "ENC28J60_TX_STORE_SIZE must be even and leave room for the transmit slots"
+#endif
+
+#if RX_BUF_END >= TX_BUF_START || (RX_BUF_END & 1) == 0
+#  error "ENC28J60_RX_BUF_END must be odd and below the transmit buffer"
+#endif
 
-#define TX_BUF_START 0x1200
+#if ENC28J60_RESERVED_END != TX_BUF_START || RX_BUF_END >= ENC28J60_RESERVED_START || (ENC28J60_RESERVED_SIZE & 1) != 0
+#  error "ENC28J60_RESERVED_SIZE must be even and leave room for the receive ring"
+#endif
 
 /* MACONx registers are in bank 2 */
 #define MACONX_BANK 0x02
@@ -62,8 +120,18 @@
 #define MABBIPG 0x04
 #define MAIPGL  0x06
 #define MAIPGH  0x07
+#define MACLCON1 0x08
+#define MACLCON2 0x09
 #define MAMXFLL 0x0a
 #define MAMXFLH 0x0b
+#define MICMD   0x12
+#define MIREGADR 0x14
+#define MIWRL   0x16
+#define MIWRH   0x17
+#define MIRDL   0x18
+#define MIRDH   0x19
+
+#define MICMD_MIIRD 0x01
 
 #define MACON1_TXPAUS 0x08
 #define MACON1_RXPAUS 0x04
@@ -76,6 +144,34 @@
 
 #define MAX_MAC_LENGTH 1518
 
+/* The received byte count includes the CRC, no real frame is shorter */
+#define MIN_RX_LENGTH 4
+
+/* Receive status vector bits in the last header byte */
+#define RSV_MULTICAST   0x01
+#define RSV_BROADCAST   0x02
+#define RSV_PAUSE_FRAME 0x10
+
+/* MAC control frames: destination, source, type, opcode, pause quanta */
+#define PAUSE_HEADER_LENGTH   18
+#define ETHERTYPE_MAC_CONTROL 0x8808
+#define PAUSE_OPCODE          0x0001
+
+/* _ENC28J60_txPoll results */
+#define ENC28J60_TX_IDLE    0
+#define ENC28J60_TX_BUSY    1
+#define ENC28J60_TX_TIMEOUT 2
+
+/* Bytes a frame occupies on the wire besides its payload: preamble and
+   SFD, CRC and the inter-packet gap. Short frames are padded to 60. */
+#define WIRE_OVERHEAD 24
+#define MIN_FRAME_LENGTH 60
+
+/* At 10Mbit/s a byte takes 0.8us and a collision slot 512 bit times,
+   as does a pause quantum */
+#define WIRE_NS_PER_BYTE 800
+#define SLOT_TIME_NS 51200
+
 #define MAADRX_BANK 0x03
 #define MAADR1 0x04 /* MAADR<47:40> */
 #define MAADR2 0x05 /* MAADR<39:32> */
@@ -86,7 +182,33 @@
 #define MISTAT 0x0a
 #define EREVID 0x12
 
+#define MISTAT_BUSY 0x01
+
+/* PHY registers */
+#define PHCON1 0x00
+#define PHCON2 0x10
+#define PHSTAT2 0x11
+#define PHIE   0x12
+#define PHIR   0x13
+
+#define PHCON1_PDPXMD 0x0100
+#define PHCON2_HDLDIS 0x0100
+#define PHSTAT2_LSTAT 0x0400
+#define PHIE_PLNKIE   0x0010
+#define PHIE_PGEIE    0x0002
+
+/* IEEE 802.3 minimum inter-packet gap of 9.6us in MABBIPG units */
+#define MABBIPG_MIN_FULL_DUPLEX 0x15
+#define MABBIPG_MIN_HALF_DUPLEX 0x12
+#define MAIPGL_MIN              0x12
+
 #define EPKTCNT_BANK 0x01
+#define EHT0    0x00
+#define EPMM0   0x08
+#define EPMCSL  0x10
+#define EPMCSH  0x11
+#define EPMOL   0x14
+#define EPMOH   0x15
 #define ERXFCON 0x18
 #define EPKTCNT 0x19
 
@@ -98,18 +220,54 @@
 #define ERXFCON_MCEN  0x02
 #define ERXFCON_BCEN  0x01
 
+/* The pattern match filter takes frames whose type and opcode are those
+   of a pause frame, bytes 12 to 15. Its checksum is the IP checksum of
+   the selected bytes, ~(0x8808 + 0x0001). */
+#define PAUSE_PATTERN_MASK     0xf0 /* EPMM1, bytes 8 to 15 */
+#define PAUSE_PATTERN_CHECKSUM 0x77f6
+
+const ENC28J60_MacTiming ENC28J60_MAC_TIMING_STANDARD = {
+  .fullDuplex = 0,
+  .backToBackGap = 0x12,
+  .nonBackToBackGapLow = 0x12,
+  .nonBackToBackGapHigh = 0x0c,
+  .maxRetransmissions = 0x0f,
+  .collisionWindow = 0x37
+};
+
+const ENC28J60_MacTiming ENC28J60_MAC_TIMING_FULL_DUPLEX_MIN = {
+  .fullDuplex = 1,
+  .backToBackGap = 0x15,
+  .nonBackToBackGapLow = 0x12,
+  .nonBackToBackGapHigh = 0x0c,
+  .maxRetransmissions = 0x0f,
+  .collisionWindow = 0x37
+};
+
+const ENC28J60_MacTiming ENC28J60_MAC_TIMING_LONG_CABLE = {
+  .fullDuplex = 0,
+  .backToBackGap = 0x12,
+  .nonBackToBackGapLow = 0x12,
+  .nonBackToBackGapHigh = 0x0c,
+  .maxRetransmissions = 0x0f,
+  .collisionWindow = 0x3f
+};
+
 uint8_t _ENC28J60_readRev(ENC28J60* enc28j60);
 int _ENC28J60_reset(ENC28J60* enc28j60);
+int _ENC28J60_resetChip(ENC28J60* enc28j60);
+void _ENC28J60_recordRecovery(ENC28J60* enc28j60, uint32_t startTime);
 uint8_t _ENC28J60_isMacMiiReg(ENC28J60* enc28j60, uint8_t reg);
 uint8_t _ENC28J60_readReg(ENC28J60* enc28j60, uint8_t reg);
-void _ENC28J60_writeReg(ENC28J60* enc28j60, uint8_t reg, uint8_t data);
-void _ENC28J60_writeReg16(ENC28J60* enc28j60, uint8_t reg, uint16_t data);
-void _ENC28J60_setRegBitField(ENC28J60* enc28j60, uint8_t reg, uint8_t mask);
-void _ENC28J60_clearRegBitField(ENC28J60* enc28j60, uint8_t reg, uint8_t mask);
-void _ENC28J60_setRegBank(ENC28J60* enc28j60, uint8_t new_bank);
-void _ENC28J60_writeData(ENC28J60* enc28j60, const uint8_t* data, int datalen);
-void _ENC28J60_writeDataByte(ENC28J60* enc28j60, uint8_t byte);
-int _ENC28J60_readData(ENC28J60* enc28j60, uint8_t* buf, int len);
+uint8_t _ENC28J60_readRegOnce(ENC28J60* enc28j60, uint8_t reg);
+HAL_StatusTypeDef _ENC28J60_writeReg(ENC28J60* enc28j60, uint8_t reg, uint8_t data);
+HAL_StatusTypeDef _ENC28J60_writeReg16(ENC28J60* enc28j60, uint8_t reg, uint16_t data);
+HAL_StatusTypeDef _ENC28J60_setRegBitField(ENC28J60* enc28j60, uint8_t reg, uint8_t mask);
+HAL_StatusTypeDef _ENC28J60_clearRegBitField(ENC28J60* enc28j60, uint8_t reg, uint8_t mask);
+HAL_StatusTypeDef _ENC28J60_setRegBank(ENC28J60* enc28j60, uint8_t new_bank);
+HAL_StatusTypeDef _ENC28J60_writeData(ENC28J60* enc28j60, const uint8_t* data, int datalen);
+HAL_StatusTypeDef _ENC28J60_writeDataByte(ENC28J60* enc28j60, uint8_t byte);
+HAL_StatusTypeDef _ENC28J60_readData(ENC28J60* enc28j60, uint8_t* buf, int len);
 uint8_t _ENC28J60_readDataByte(ENC28J60* enc28j60);
 void _ENC28J60_softReset(ENC28J60* enc28j60);
 void _ENC28J60_spiAssert(ENC28J60* enc28j60);
@@ -117,12 +275,102 @@ void _ENC28J60_spiDeassert(ENC28J60* enc28j60);
 void _ENC28J60_resetAssert(ENC28J60* enc28j60);
 void _ENC28J60_resetDeassert(ENC28J60* enc28j60);
 uint8_t _ENC28J60_spiTx(ENC28J60* enc28j60, uint8_t value);
+void _ENC28J60_spiStart(ENC28J60* enc28j60, const uint8_t* tx, uint8_t* rx, uint16_t len);
+HAL_StatusTypeDef _ENC28J60_spiWait(ENC28J60* enc28j60, uint8_t* rx, uint16_t len);
+void _ENC28J60_spiComplete(ENC28J60* enc28j60, HAL_StatusTypeDef status, uint8_t* rx, uint16_t len);
+uint32_t _ENC28J60_spiTimeout(uint16_t len);
+void _ENC28J60_spiTransfer(ENC28J60* enc28j60, const uint8_t* tx, uint8_t* rx, uint16_t len);
+uint16_t _ENC28J60_spiDmaLength(const uint8_t* rx, uint16_t len, uint16_t* head);
+void _ENC28J60_cacheClean(const uint8_t* addr, uint16_t len);
+void _ENC28J60_cacheInvalidate(uint8_t* addr, uint16_t len);
+int _ENC28J60_writePhy(ENC28J60* enc28j60, uint8_t reg, uint16_t data);
+uint16_t _ENC28J60_readPhy(ENC28J60* enc28j60, uint8_t reg);
+int _ENC28J60_waitPhy(ENC28J60* enc28j60);
+void _ENC28J60_writeMacTiming(ENC28J60* enc28j60);
+void _ENC28J60_readTsv(ENC28J60* enc28j60, uint16_t dataend, uint8_t* tsv);
+void _ENC28J60_updateTxStats(ENC28J60* enc28j60, const uint8_t* tsv);
+void _ENC28J60_waitTxPacing(ENC28J60* enc28j60);
+uint32_t _ENC28J60_txPacingGap(ENC28J60* enc28j60);
+uint16_t _ENC28J60_wireBytes(uint16_t datalen);
+uint32_t _ENC28J60_txTimeout(ENC28J60* enc28j60, uint16_t datalen);
+uint32_t _ENC28J60_deadline(uint32_t timeoutUs);
+uint8_t _ENC28J60_deadlinePassed(uint32_t deadline);
+void _ENC28J60_tokenBucketSetup(ENC28J60_TokenBucket* bucket, uint32_t rate, uint32_t burst);
+void _ENC28J60_tokenBucketRefill(ENC28J60_TokenBucket* bucket);
+void _ENC28J60_tokenBucketTake(ENC28J60_TokenBucket* bucket, uint16_t bytes);
+uint8_t _ENC28J60_tokenBucketTryTake(ENC28J60_TokenBucket* bucket, uint16_t bytes);
+uint16_t _ENC28J60_txUpload(ENC28J60* enc28j60, uint16_t start, const uint8_t* data, uint16_t datalen);
+void _ENC28J60_txArm(ENC28J60* enc28j60, uint16_t start, uint16_t dataend);
+void _ENC28J60_txArmScheduled(ENC28J60* enc28j60);
+void _ENC28J60_txStart(ENC28J60* enc28j60, uint16_t start, uint16_t dataend);
+uint8_t _ENC28J60_txFitsBeforeScheduled(ENC28J60* enc28j60, uint16_t datalen);
+uint32_t _ENC28J60_wireTime(uint16_t datalen);
+int _ENC28J60_txPoll(ENC28J60* enc28j60);
+int _ENC28J60_txWaitIdle(ENC28J60* enc28j60);
+void _ENC28J60_txRecord(ENC28J60* enc28j60, uint8_t status, const uint8_t* tsv, uint32_t now);
+ENC28J60_StoredFrame* _ENC28J60_findStored(ENC28J60* enc28j60, uint32_t handle);
+uint16_t _ENC28J60_storeGapAt(ENC28J60* enc28j60, uint16_t start);
+uint16_t _ENC28J60_storeFindGap(ENC28J60* enc28j60, uint16_t size, uint16_t* largest);
+void _ENC28J60_txTap(ENC28J60* enc28j60, const uint8_t* data, uint16_t datalen);
+void _ENC28J60_txTapChip(ENC28J60* enc28j60, uint16_t start, uint16_t datalen);
+HAL_StatusTypeDef _ENC28J60_txWriteAt(ENC28J60* enc28j60, uint16_t offset, const uint8_t* data, uint16_t len);
+void _ENC28J60_rxFinish(ENC28J60* enc28j60, uint8_t delivered);
+uint16_t _ENC28J60_rxAddress(ENC28J60* enc28j60, uint16_t offset);
+HAL_StatusTypeDef _ENC28J60_readAt(ENC28J60* enc28j60, uint16_t address, uint8_t* buf, uint16_t len);
+HAL_StatusTypeDef _ENC28J60_queueEntry(
+  ENC28J60* enc28j60,
+  ENC28J60_TxClass txClass,
+  const uint8_t* data,
+  uint16_t datalen,
+  ENC28J60_Frame* frame
+);
+ENC28J60_TxQueue* _ENC28J60_txNextQueue(ENC28J60* enc28j60);
+void _ENC28J60_writeReceiveFilters(ENC28J60* enc28j60);
+uint8_t _ENC28J60_hashTableBit(const uint8_t* macAddress);
+int _ENC28J60_findMacSlot(ENC28J60* enc28j60, const uint8_t* macAddress);
+uint8_t _ENC28J60_acceptDestination(ENC28J60* enc28j60, const uint8_t* destination);
+void _ENC28J60_writeInterruptEnables(ENC28J60* enc28j60);
+uint8_t _ENC28J60_interruptEnables(uint8_t events);
+uint8_t _ENC28J60_txEdgeIsCompletion(ENC28J60* enc28j60);
+uint8_t _ENC28J60_isValidRxHeader(ENC28J60* enc28j60, uint16_t next, uint16_t len);
+void _ENC28J60_rxResync(ENC28J60* enc28j60);
+void _ENC28J60_rxPause(ENC28J60* enc28j60, uint16_t len);
+void _ENC28J60_writeRxPointers(ENC28J60* enc28j60);
+void _ENC28J60_writeMacAddress(ENC28J60* enc28j60);
 
 HAL_StatusTypeDef ENC28J60_setup(ENC28J60* enc28j60) {
   enc28j60->bank = ERXTX_BANK;
   enc28j60->receivedPackets = 0;
   enc28j60->sentPackets = 0;
-  periodicTimer_setup(&enc28j60->watchDogTimer, 30 * 1000);
+  enc28j60->filteredPackets = 0;
+  memset(enc28j60->extraMacs, 0, sizeof(enc28j60->extraMacs));
+  enc28j60->extraMacCount = 0;
+  enc28j60->macTiming = ENC28J60_MAC_TIMING_FULL_DUPLEX_MIN;
+  memset(&enc28j60->txStats, 0, sizeof(enc28j60->txStats));
+  enc28j60->txPacing = 0;
+  enc28j60->collisionScore = 0;
+  enc28j60->lastTxTime = ENC28J60_MICROS();
+  enc28j60->interruptEvents = 0;
+  enc28j60->spiStatus = HAL_OK;
+  memset(&enc28j60->spiStats, 0, sizeof(enc28j60->spiStats));
+  memset(&enc28j60->rxStats, 0, sizeof(enc28j60->rxStats));
+  _ENC28J60_tokenBucketSetup(&enc28j60->txShaper, 0, 0);
+  memset(enc28j60->txQueues, 0, sizeof(enc28j60->txQueues));
+  memset(&enc28j60->recoveryStats, 0, sizeof(enc28j60->recoveryStats));
+  enc28j60->frameTap = NULL;
+  enc28j60->frameTapContext = NULL;
+  enc28j60->frameTapBuffer = NULL;
+  enc28j60->frameTapBufferSize = 0;
+  enc28j60->txSequence = 0;
+  enc28j60->txTimestamping = 0;
+  enc28j60->txCompletion = NULL;
+  enc28j60->txCompletionContext = NULL;
+  memset(&enc28j60->txLast, 0, sizeof(enc28j60->txLast));
+  enc28j60->txStoreHandle = 0;
+  enc28j60->txStoreClock = 0;
+  enc28j60->txStoreEvictions = 0;
+  enc28j60->txPauseAllowance = 0;
+  periodicTimer_setup(&enc28j60->watchDogTimer, ENC28J60_WATCHDOG_PERIOD);
   while(_ENC28J60_reset(enc28j60) != 0);
   ENC28J60_DEBUG_OUT("ENC28J60 rev. B%d\n", _ENC28J60_readRev(enc28j60));
   return HAL_OK;
@@ -142,7 +390,29 @@ uint8_t _ENC28J60_isMacMiiReg(ENC28J60* enc28j60, uint8_t reg) {
   }
 }
 
+/* Register reads have no side effects, so a read that hit an SPI error is
+   simply repeated. The error stays in spiStatus if every attempt fails. */
 uint8_t _ENC28J60_readReg(ENC28J60* enc28j60, uint8_t reg) {
+  HAL_StatusTypeDef previous;
+  uint8_t r;
+  int attempt;
+
+  previous = enc28j60->spiStatus;
+  for (attempt = 0; ; attempt++) {
+    enc28j60->spiStatus = HAL_OK;
+    r = _ENC28J60_readRegOnce(enc28j60, reg);
+    if (enc28j60->spiStatus == HAL_OK || attempt >= ENC28J60_SPI_RETRIES) {
+      break;
+    }
+    enc28j60->spiStats.retries++;
+  }
+  if (enc28j60->spiStatus == HAL_OK) {
+    enc28j60->spiStatus = previous;
+  }
+  return r;
+}
+
+uint8_t _ENC28J60_readRegOnce(ENC28J60* enc28j60, uint8_t reg) {
   uint8_t r;
   _ENC28J60_spiAssert(enc28j60);
   _ENC28J60_spiTx(enc28j60, 0x00 | (reg & 0x1f));
@@ -155,19 +425,20 @@ uint8_t _ENC28J60_readReg(ENC28J60* enc28j60, uint8_t reg) {
   return r;
 }
 
-void _ENC28J60_writeReg16(ENC28J60* enc28j60, uint8_t reg, uint16_t data) {
+HAL_StatusTypeDef _ENC28J60_writeReg16(ENC28J60* enc28j60, uint8_t reg, uint16_t data) {
   _ENC28J60_writeReg(enc28j60, reg, data & 0xff);
-  _ENC28J60_writeReg(enc28j60, reg + 1, (data >> 8) & 0xff);
+  return _ENC28J60_writeReg(enc28j60, reg + 1, (data >> 8) & 0xff);
 }
 
-void _ENC28J60_writeReg(ENC28J60* enc28j60, uint8_t reg, uint8_t data) {
+HAL_StatusTypeDef _ENC28J60_writeReg(ENC28J60* enc28j60, uint8_t reg, uint8_t data) {
   _ENC28J60_spiAssert(enc28j60);
   _ENC28J60_spiTx(enc28j60, 0x40 | (reg & 0x1f));
   _ENC28J60_spiTx(enc28j60, data);
   _ENC28J60_spiDeassert(enc28j60);
+  return enc28j60->spiStatus;
 }
 
-void _ENC28J60_setRegBitField(ENC28J60* enc28j60, uint8_t reg, uint8_t mask) {
+HAL_StatusTypeDef _ENC28J60_setRegBitField(ENC28J60* enc28j60, uint8_t reg, uint8_t mask) {
   if (_ENC28J60_isMacMiiReg(enc28j60, reg)) {
     _ENC28J60_writeReg(enc28j60, reg, _ENC28J60_readReg(enc28j60, reg) | mask);
   } else {
@@ -176,9 +447,10 @@ void _ENC28J60_setRegBitField(ENC28J60* enc28j60, uint8_t reg, uint8_t mask) {
     _ENC28J60_spiTx(enc28j60, mask);
     _ENC28J60_spiDeassert(enc28j60);
   }
+  return enc28j60->spiStatus;
 }
 
-void _ENC28J60_clearRegBitField(ENC28J60* enc28j60, uint8_t reg, uint8_t mask) {
+HAL_StatusTypeDef _ENC28J60_clearRegBitField(ENC28J60* enc28j60, uint8_t reg, uint8_t mask) {
   if (_ENC28J60_isMacMiiReg(enc28j60, reg)) {
     _ENC28J60_writeReg(enc28j60, reg, _ENC28J60_readReg(enc28j60, reg) & ~mask);
   } else {
@@ -187,38 +459,52 @@ void _ENC28J60_clearRegBitField(ENC28J60* enc28j60, uint8_t reg, uint8_t mask) {
     _ENC28J60_spiTx(enc28j60, mask);
     _ENC28J60_spiDeassert(enc28j60);
   }
+  return enc28j60->spiStatus;
 }
 
-void _ENC28J60_setRegBank(ENC28J60* enc28j60, uint8_t new_bank) {
-  _ENC28J60_writeReg(enc28j60, ECON1, (_ENC28J60_readReg(enc28j60, ECON1) & 0xfc) | (new_bank & 0x03));
-  enc28j60->bank = new_bank;
+HAL_StatusTypeDef _ENC28J60_setRegBank(ENC28J60* enc28j60, uint8_t new_bank) {
+  if (enc28j60->bank == new_bank) {
+    return enc28j60->spiStatus;
+  }
+
+  /* Bit field clear and set instead of read-modify-write, so a garbled
+     read can't take TXRTS or RXEN with it */
+  _ENC28J60_clearRegBitField(enc28j60, ECON1, 0x03);
+  if ((new_bank & 0x03) != 0) {
+    _ENC28J60_setRegBitField(enc28j60, ECON1, new_bank & 0x03);
+  }
+
+  /* If the switch may not have made it, force the next one through */
+  enc28j60->bank = enc28j60->spiStatus == HAL_OK ? new_bank : BANK_UNKNOWN;
+  return enc28j60->spiStatus;
 }
 
-void _ENC28J60_writeData(ENC28J60* enc28j60, const uint8_t* data, int datalen) {
-  int i;
+HAL_StatusTypeDef _ENC28J60_writeData(ENC28J60* enc28j60, const uint8_t* data, int datalen) {
   _ENC28J60_spiAssert(enc28j60);
   /* The Write Buffer Memory (WBM) command is 0 1 1 1 1 0 1 0  */
   _ENC28J60_spiTx(enc28j60, 0x7a);
-  for (i = 0; i < datalen; i++) {
-    _ENC28J60_spiTx(enc28j60, data[i]);
+  if (datalen > 0) {
+    _ENC28J60_spiStart(enc28j60, data, NULL, datalen);
+    _ENC28J60_spiWait(enc28j60, NULL, datalen);
   }
   _ENC28J60_spiDeassert(enc28j60);
+  return enc28j60->spiStatus;
 }
 
-void _ENC28J60_writeDataByte(ENC28J60* enc28j60, uint8_t byte) {
-  _ENC28J60_writeData(enc28j60, &byte, 1);
+HAL_StatusTypeDef _ENC28J60_writeDataByte(ENC28J60* enc28j60, uint8_t byte) {
+  return _ENC28J60_writeData(enc28j60, &byte, 1);
 }
 
-int _ENC28J60_readData(ENC28J60* enc28j60, uint8_t* buf, int len) {
-  int i;
+HAL_StatusTypeDef _ENC28J60_readData(ENC28J60* enc28j60, uint8_t* buf, int len) {
   _ENC28J60_spiAssert(enc28j60);
   /* THe Read Buffer Memory (RBM) command is 0 0 1 1 1 0 1 0 */
   _ENC28J60_spiTx(enc28j60, 0x3a);
-  for (i = 0; i < len; i++) {
-    buf[i] = _ENC28J60_spiTx(enc28j60, 0x00);
+  if (len > 0) {
+    _ENC28J60_spiStart(enc28j60, NULL, buf, len);
+    _ENC28J60_spiWait(enc28j60, buf, len);
   }
   _ENC28J60_spiDeassert(enc28j60);
-  return i;
+  return enc28j60->spiStatus;
 }
 
 uint8_t _ENC28J60_readDataByte(ENC28J60* enc28j60) {
@@ -237,6 +523,38 @@ void _ENC28J60_softReset(ENC28J60* enc28j60) {
   enc28j60->bank = ERXTX_BANK;
 }
 
+int _ENC28J60_writePhy(ENC28J60* enc28j60, uint8_t reg, uint16_t data) {
+  _ENC28J60_setRegBank(enc28j60, MACONX_BANK);
+  _ENC28J60_writeReg(enc28j60, MIREGADR, reg);
+  _ENC28J60_writeReg(enc28j60, MIWRL, data & 0xff);
+  _ENC28J60_writeReg(enc28j60, MIWRH, (data >> 8) & 0xff);
+  return _ENC28J60_waitPhy(enc28j60);
+}
+
+uint16_t _ENC28J60_readPhy(ENC28J60* enc28j60, uint8_t reg) {
+  _ENC28J60_setRegBank(enc28j60, MACONX_BANK);
+  _ENC28J60_writeReg(enc28j60, MIREGADR, reg);
+  _ENC28J60_writeReg(enc28j60, MICMD, MICMD_MIIRD);
+  _ENC28J60_waitPhy(enc28j60);
+
+  _ENC28J60_setRegBank(enc28j60, MACONX_BANK);
+  _ENC28J60_writeReg(enc28j60, MICMD, 0);
+  return (_ENC28J60_readReg(enc28j60, MIRDH) << 8) | _ENC28J60_readReg(enc28j60, MIRDL);
+}
+
+int _ENC28J60_waitPhy(ENC28J60* enc28j60) {
+  /* MII operations take 10.24us, wait for MISTAT.BUSY to clear */
+  _ENC28J60_setRegBank(enc28j60, MAADRX_BANK);
+  uint32_t deadline = _ENC28J60_deadline(ENC28J60_PHY_TIMEOUT_US);
+  while ((_ENC28J60_readReg(enc28j60, MISTAT) & MISTAT_BUSY) != 0) {
+    if (_ENC28J60_deadlinePassed(deadline)) {
+      ENC28J60_DEBUG_OUT("timeout waiting for phy\n");
+      return 1;
+    }
+  }
+  return 0;
+}
+
 uint8_t _ENC28J60_readRev(ENC28J60* enc28j60) {
   uint8_t rev;
   _ENC28J60_setRegBank(enc28j60, MAADRX_BANK);
@@ -252,6 +570,29 @@ uint8_t _ENC28J60_readRev(ENC28J60* enc28j60) {
 }
 
 int _ENC28J60_reset(ENC28J60* enc28j60) {
+  uint32_t startTime;
+
+  startTime = ENC28J60_MICROS();
+  enc28j60->recoveryStats.resets++;
+  if (_ENC28J60_resetChip(enc28j60) != 0) {
+    enc28j60->recoveryStats.failedResets++;
+    return 1;
+  }
+  _ENC28J60_recordRecovery(enc28j60, startTime);
+  return 0;
+}
+
+void _ENC28J60_recordRecovery(ENC28J60* enc28j60, uint32_t startTime) {
+  uint32_t duration;
+
+  duration = ENC28J60_MICROS() - startTime;
+  enc28j60->recoveryStats.lastDuration = duration;
+  if (duration > enc28j60->recoveryStats.maxDuration) {
+    enc28j60->recoveryStats.maxDuration = duration;
+  }
+}
+
+int _ENC28J60_resetChip(ENC28J60* enc28j60) {
   ENC28J60_DEBUG_OUT("resetting chip\n");
 
   /*
@@ -316,32 +657,36 @@ int _ENC28J60_reset(ENC28J60* enc28j60) {
   sleep_ms(2);
   _ENC28J60_resetDeassert(enc28j60);
   sleep_ms(2);
+  enc28j60->bank = ERXTX_BANK;
 
   // Not needed? _ENC28J60_softReset(enc28j60);
 
   /* Workaround for erratum #2. */
   sleep_ms(2);
 
+  /* Whatever was being sent, scheduled, built or retained is gone */
+  enc28j60->txInFlight = 0;
+  enc28j60->txScheduled = 0;
+  enc28j60->txScheduledArmed = 0;
+  enc28j60->txBuilding = 0;
+  memset(enc28j60->txStore, 0, sizeof(enc28j60->txStore));
+  enc28j60->spiStatus = HAL_OK;
+
   /* Wait for OST */
   ENC28J60_DEBUG_OUT("Wait for OST\n");
-  uint32_t timeoutTime = HAL_GetTick() + 5000;
+  uint32_t deadline = _ENC28J60_deadline(ENC28J60_OST_TIMEOUT_US);
   while ((_ENC28J60_readReg(enc28j60, ESTAT) & ESTAT_CLKRDY) == 0) {
-    if (HAL_GetTick() > timeoutTime) {
+    if (_ENC28J60_deadlinePassed(deadline)) {
       return 1;
     }
   }
   ENC28J60_DEBUG_OUT("DONE Wait for OST\n");
 
-  _ENC28J60_setRegBank(enc28j60, ERXTX_BANK);
   /* Set up receive buffer */
-  _ENC28J60_writeReg16(enc28j60, ERXSTL, RX_BUF_START);
-  _ENC28J60_writeReg16(enc28j60, ERXNDL, RX_BUF_END);
-  _ENC28J60_writeReg16(enc28j60, ERDPTL, RX_BUF_START);
-  _ENC28J60_writeReg16(enc28j60, ERXRDPTL, RX_BUF_END);
+  _ENC28J60_writeRxPointers(enc28j60);
 
   /* Receive filters */
-  _ENC28J60_setRegBank(enc28j60, EPKTCNT_BANK);
-  _ENC28J60_writeReg(enc28j60, ERXFCON, ERXFCON_UCEN | ERXFCON_CRCEN | ERXFCON_BCEN);
+  _ENC28J60_writeReceiveFilters(enc28j60);
 
   /*
     6.5 MAC Initialization Settings
@@ -393,14 +738,14 @@ int _ENC28J60_reset(ENC28J60* enc28j60) {
 
   _ENC28J60_setRegBank(enc28j60, MACONX_BANK);
 
-  /* Turn on reception and IEEE-defined flow control */
-  _ENC28J60_setRegBitField(enc28j60, MACON1, MACON1_MARXEN | MACON1_TXPAUS | MACON1_RXPAUS);
+  /* Turn on reception */
+  _ENC28J60_setRegBitField(enc28j60, MACON1, MACON1_MARXEN);
 
-  /* Set padding, crc, full duplex */
+  /* Set padding, crc */
   _ENC28J60_setRegBitField(
     enc28j60,
     MACON3,
-    MACON3_PADCFG_FULL | MACON3_TXCRCEN | MACON3_FULDPX | MACON3_FRMLNEN
+    MACON3_PADCFG_FULL | MACON3_TXCRCEN | MACON3_FRMLNEN
   );
 
   /* Don't modify MACON4 */
@@ -408,20 +753,12 @@ int _ENC28J60_reset(ENC28J60* enc28j60) {
   /* Set maximum frame length in MAMXFL */
   _ENC28J60_writeReg16(enc28j60, MAMXFLL, MAX_MAC_LENGTH);
 
-  /* Set back-to-back inter packet gap */
-  _ENC28J60_writeReg(enc28j60, MABBIPG, 0x15);
-
-  /* Set non-back-to-back packet gap */
-  _ENC28J60_writeReg(enc28j60, MAIPGL, 0x12);
+  /* Set duplex, flow control, inter packet gaps and collision settings,
+     also programs PHCON1.PDPXMD to match MACON3.FULDPX */
+  _ENC28J60_writeMacTiming(enc28j60);
 
   /* Set MAC address */
-  _ENC28J60_setRegBank(enc28j60, MAADRX_BANK);
-  _ENC28J60_writeReg(enc28j60, MAADR6, enc28j60->macAddress[5]);
-  _ENC28J60_writeReg(enc28j60, MAADR5, enc28j60->macAddress[4]);
-  _ENC28J60_writeReg(enc28j60, MAADR4, enc28j60->macAddress[3]);
-  _ENC28J60_writeReg(enc28j60, MAADR3, enc28j60->macAddress[2]);
-  _ENC28J60_writeReg(enc28j60, MAADR2, enc28j60->macAddress[1]);
-  _ENC28J60_writeReg(enc28j60, MAADR1, enc28j60->macAddress[0]);
+  _ENC28J60_writeMacAddress(enc28j60);
 
   /*
     6.6 PHY Initialization Settings
@@ -449,13 +786,19 @@ int _ENC28J60_reset(ENC28J60* enc28j60) {
     Register 2-2 (page 9).
   */
 
-  /* Don't worry about PHY configuration for now */
+  /* Duplex is configured by _ENC28J60_writeMacTiming, leave the LEDs alone */
+
+  /* Restore the interrupt sources if ENC28J60_enableInterrupts was used */
+  if (enc28j60->interruptEvents != 0) {
+    _ENC28J60_writeInterruptEnables(enc28j60);
+  }
 
   /* Turn on autoincrement for buffer access */
   _ENC28J60_setRegBitField(enc28j60, ECON2, ECON2_AUTOINC);
 
   /* Turn on reception */
   _ENC28J60_writeReg(enc28j60, ECON1, ECON1_RXEN);
+  enc28j60->bank = ERXTX_BANK;
   
   return 0;
 }
@@ -463,198 +806,2039 @@ int _ENC28J60_reset(ENC28J60* enc28j60) {
 int ENC28J60_send(ENC28J60* enc28j60, const uint8_t* data, uint16_t datalen) {
   uint16_t dataend;
 
-  /*
-    1. Appropriately program the ETXST pointer to point to an unused
-       location in memory. It will point to the per packet control
-       byte. In the example, it would be programmed to 0120h. It is
-       recommended that an even address be used for ETXST.
-
-    2. Use the WBM SPI command to write the per packet control byte,
-       the destination address, the source MAC address, the
-       type/length and the data payload.
+  if (datalen > ENC28J60_MAX_TX_LENGTH) {
+    ENC28J60_DEBUG_OUT("tx err: frame too long %d\n", datalen);
+    return 0;
+  }
 
-    3. Appropriately program the ETXND pointer. It should point to the
-       last byte in the data payload.  In the example, it would be
-       programmed to 0156h.
+  /* The frame under construction owns the transmit slot */
+  if (enc28j60->txBuilding) {
+    ENC28J60_DEBUG_OUT("tx err: frame under construction\n");
+    return 0;
+  }
 
-    4. Clear EIR.TXIF, set EIE.TXIE and set EIE.INTIE to enable an
-       interrupt when done (if desired).
+  /* A scheduled frame keeps its launch time, go after it if this one
+     could still be on the wire by then */
+  while (!_ENC28J60_txFitsBeforeScheduled(enc28j60, datalen)) {
+    ENC28J60_pollScheduled(enc28j60);
+  }
 
-    5. Start the transmission process by setting
-       ECON1.TXRTS.
-  */
+  /* Let a frame started by ENC28J60_serviceTx finish first */
+  _ENC28J60_txWaitIdle(enc28j60);
 
-  _ENC28J60_setRegBank(enc28j60, ERXTX_BANK);
-  /* Set up the transmit buffer pointer */
-  _ENC28J60_writeReg16(enc28j60, ETXSTL, TX_BUF_START);
-  _ENC28J60_writeReg16(enc28j60, EWRPTL, TX_BUF_START);
+  enc28j60->spiStatus = HAL_OK;
+  dataend = _ENC28J60_txUpload(enc28j60, TX_BUF_START, data, datalen);
+  _ENC28J60_txArm(enc28j60, TX_BUF_START, dataend);
+  if (enc28j60->spiStatus != HAL_OK) {
+    /* Don't send whatever made it into the buffer */
+    ENC28J60_DEBUG_OUT("tx err: spi error uploading frame\n");
+    enc28j60->spiStats.txAborts++;
+    return 0;
+  }
+  _ENC28J60_txTap(enc28j60, data, datalen);
 
-  /* Write the transmission control register as the first byte of the
-     output packet. We write 0x00 to indicate that the default
-     configuration (the values in MACON3) will be used.  */
-  _ENC28J60_writeDataByte(enc28j60, 0x00); /* MACON3 */
+  /* Hold the frame back until the shaper and the collision pacing let
+     it out, so the time spent waiting is not counted against the
+     transmit timeout */
+  _ENC28J60_tokenBucketTake(&enc28j60->txShaper, _ENC28J60_wireBytes(datalen));
+  _ENC28J60_waitTxPacing(enc28j60);
 
-  _ENC28J60_writeData(enc28j60, data, datalen);
+  /* Send the packet */
+  _ENC28J60_txStart(enc28j60, TX_BUF_START, dataend);
+  if (_ENC28J60_txWaitIdle(enc28j60) != 0) {
+    return 0;
+  }
 
-  /* Write a pointer to the last data byte. */
-  dataend = TX_BUF_START + datalen;
-  _ENC28J60_writeReg16(enc28j60, ETXNDL, dataend);
+  ENC28J60_DEBUG_OUT("tx: %d: %02x:%02x:%02x:%02x:%02x:%02x\n", datalen,
+                     data[0], data[1], data[2],
+                     data[3], data[4], data[5]);
+  return datalen;
+}
 
-  /* Clear EIR.TXIF */
-  _ENC28J60_clearRegBitField(enc28j60, EIR, EIR_TXIF);
+HAL_StatusTypeDef ENC28J60_queue(ENC28J60* enc28j60, ENC28J60_TxClass txClass, const uint8_t* data, uint16_t datalen) {
+  return _ENC28J60_queueEntry(enc28j60, txClass, data, datalen, NULL);
+}
 
-  /* Don't care about interrupts for now */
+HAL_StatusTypeDef ENC28J60_queueFrame(ENC28J60* enc28j60, ENC28J60_TxClass txClass, ENC28J60_Frame* frame) {
+  return _ENC28J60_queueEntry(enc28j60, txClass, frame->data, frame->length, frame);
+}
 
-  /* Send the packet */
-  _ENC28J60_setRegBitField(enc28j60, ECON1, ECON1_TXRTS);
-  uint32_t timeoutTime = HAL_GetTick() + 5000;
-  while ((_ENC28J60_readReg(enc28j60, ECON1) & ECON1_TXRTS) > 0) {
-    if (HAL_GetTick() > timeoutTime) {
-      ENC28J60_DEBUG_OUT("timeout sending packet\n");
-      return 0;
-    }
+HAL_StatusTypeDef _ENC28J60_queueEntry(
+  ENC28J60* enc28j60,
+  ENC28J60_TxClass txClass,
+  const uint8_t* data,
+  uint16_t datalen,
+  ENC28J60_Frame* frame
+) {
+  ENC28J60_TxQueue* queue = &enc28j60->txQueues[txClass];
+  ENC28J60_TxEntry* entry;
+
+  /* It would not fit its transmit slot */
+  if (datalen > ENC28J60_MAX_TX_LENGTH) {
+    ENC28J60_frameRelease(frame);
+    return HAL_ERROR;
+  }
+  if (queue->count >= ENC28J60_TX_QUEUE_DEPTH) {
+    queue->dropped++;
+    ENC28J60_frameRelease(frame);
+    return HAL_BUSY;
   }
 
-#ifdef ENC28J60_DEBUG
-  if ((_ENC28J60_readReg(enc28j60, ESTAT) & ESTAT_TXABRT) != 0) {
-    uint16_t erdpt;
-    uint8_t tsv[7];
-    erdpt = (_ENC28J60_readReg(enc28j60, ERDPTH) << 8) | _ENC28J60_readReg(enc28j60, ERDPTL);
-    _ENC28J60_writeReg16(enc28j60, ERDPTL, dataend + 1);
-    _ENC28J60_readData(enc28j60, tsv, sizeof(tsv));
-    _ENC28J60_writeReg16(enc28j60, ERDPTL, erdpt);
-    ENC28J60_DEBUG_OUT("tx err: %d: %02x:%02x:%02x:%02x:%02x:%02x\n"
-                       "                  tsv: %02x%02x%02x%02x%02x%02x%02x\n", datalen,
-                       data[0], data[1], data[2],
-                       data[3], data[4], data[5],
-                       tsv[6], tsv[5], tsv[4], tsv[3], tsv[2], tsv[1], tsv[0]);
-  } else {
-    ENC28J60_DEBUG_OUT("tx: %d: %02x:%02x:%02x:%02x:%02x:%02x\n", datalen,
-                       data[0], data[1], data[2],
-                       data[3], data[4], data[5]);
+  entry = &queue->entries[(queue->head + queue->count) % ENC28J60_TX_QUEUE_DEPTH];
+  entry->data = data;
+  entry->length = datalen;
+  entry->queuedTime = ENC28J60_MICROS();
+  entry->frame = frame;
+  queue->count++;
+  if (queue->count > queue->maxDepth) {
+    queue->maxDepth = queue->count;
   }
-#endif
 
-  enc28j60->sentPackets++;
-  ENC28J60_DEBUG_OUT("sentPackets %d\n", enc28j60->sentPackets);
-  return datalen;
+  ENC28J60_serviceTx(enc28j60);
+  return HAL_OK;
 }
 
-int ENC28J60_receive(ENC28J60* enc28j60, uint8_t* buffer, uint16_t bufsize) {
-  int n, len, next, err;
+void ENC28J60_serviceTx(ENC28J60* enc28j60) {
+  ENC28J60_TxQueue* queue;
+  ENC28J60_TxEntry* entry;
+  uint32_t latency;
+  uint16_t dataend;
 
-  uint8_t nxtpkt[2];
-  uint8_t status[2];
-  uint8_t length[2];
+  if (enc28j60->txInFlight && _ENC28J60_txPoll(enc28j60) == ENC28J60_TX_BUSY) {
+    return;
+  }
+  if (ENC28J60_pollScheduled(enc28j60) == HAL_OK || enc28j60->txBuilding) {
+    return;
+  }
 
-  err = 0;
+  queue = _ENC28J60_txNextQueue(enc28j60);
+  if (queue == NULL) {
+    return;
+  }
+  entry = &queue->entries[queue->head];
 
-  _ENC28J60_setRegBank(enc28j60, EPKTCNT_BANK);
-  n = _ENC28J60_readReg(enc28j60, EPKTCNT);
+  /* Leave the frame queued if the shaper or the pacing hold it back, or
+     if it would delay a scheduled frame */
+  if (!_ENC28J60_txFitsBeforeScheduled(enc28j60, entry->length)) {
+    return;
+  }
+  if ((uint32_t) (ENC28J60_MICROS() - enc28j60->lastTxTime) < _ENC28J60_txPacingGap(enc28j60)) {
+    return;
+  }
+  if (!_ENC28J60_tokenBucketTryTake(&enc28j60->txShaper, _ENC28J60_wireBytes(entry->length))) {
+    return;
+  }
 
-  if (n == 0) {
-    return 0;
+  enc28j60->spiStatus = HAL_OK;
+  dataend = _ENC28J60_txUpload(enc28j60, TX_BUF_START, entry->data, entry->length);
+  _ENC28J60_txArm(enc28j60, TX_BUF_START, dataend);
+  if (enc28j60->spiStatus != HAL_OK) {
+    /* Leave the frame queued and upload it again on the next call */
+    enc28j60->spiStats.txAborts++;
+    return;
   }
+  _ENC28J60_txTap(enc28j60, entry->data, entry->length);
+  _ENC28J60_txStart(enc28j60, TX_BUF_START, dataend);
 
-  ENC28J60_DEBUG_OUT("EPKTCNT 0x%02x\n", n);
+  /* The frame is in chip memory now, its buffer can go back */
+  ENC28J60_frameRelease(entry->frame);
+  entry->frame = NULL;
 
-  _ENC28J60_setRegBank(enc28j60, ERXTX_BANK);
-  /* Read the next packet pointer */
-  nxtpkt[0] = _ENC28J60_readDataByte(enc28j60);
-  nxtpkt[1] = _ENC28J60_readDataByte(enc28j60);
+  latency = ENC28J60_MICROS() - entry->queuedTime;
+  queue->totalLatency += latency;
+  if (latency > queue->maxLatency) {
+    queue->maxLatency = latency;
+  }
+  queue->sent++;
+  queue->head = (queue->head + 1) % ENC28J60_TX_QUEUE_DEPTH;
+  queue->count--;
+}
+
+void ENC28J60_framePoolSetup(ENC28J60_FramePool* pool) {
+  int i;
 
-  ENC28J60_DEBUG_OUT("nxtpkt 0x%02x%02x\n", nxtpkt[1], nxtpkt[0]);
+  pool->free = NULL;
+  for (i = 0; i < ENC28J60_FRAME_POOL_SIZE; i++) {
+    pool->frames[i].pool = pool;
+    pool->frames[i].length = 0;
+    pool->frames[i].next = pool->free;
+    pool->free = &pool->frames[i];
+  }
+  pool->available = ENC28J60_FRAME_POOL_SIZE;
+}
 
-  length[0] = _ENC28J60_readDataByte(enc28j60);
-  length[1] = _ENC28J60_readDataByte(enc28j60);
+ENC28J60_Frame* ENC28J60_frameAcquire(ENC28J60_FramePool* pool) {
+  ENC28J60_Frame* frame;
 
-  ENC28J60_DEBUG_OUT("length 0x%02x%02x\n", length[1], length[0]);
+  frame = pool->free;
+  if (frame == NULL) {
+    return NULL;
+  }
+  pool->free = frame->next;
+  pool->available--;
 
-  status[0] = _ENC28J60_readDataByte(enc28j60);
-  status[1] = _ENC28J60_readDataByte(enc28j60);
+  frame->next = NULL;
+  frame->length = 0;
+  return frame;
+}
 
-  /* This statement is just to avoid a compiler warning: */
-  status[0] = status[0];
-  ENC28J60_DEBUG_OUT("status 0x%02x%02x\n", status[1], status[0]);
+void ENC28J60_frameRelease(ENC28J60_Frame* frame) {
+  if (frame == NULL) {
+    return;
+  }
+  frame->next = frame->pool->free;
+  frame->pool->free = frame;
+  frame->pool->available++;
+}
 
-  len = (length[1] << 8) + length[0];
-  if (bufsize >= len) {
-    _ENC28J60_readData(enc28j60, buffer, len);
-  } else {
-    uint16_t i;
+ENC28J60_Frame* ENC28J60_receiveFrame(ENC28J60* enc28j60, ENC28J60_FramePool* pool) {
+  ENC28J60_Frame* frame;
+  int len;
 
-    err = 1;
+  frame = ENC28J60_frameAcquire(pool);
+  if (frame == NULL) {
+    return NULL;
+  }
 
-    /* flush rx fifo */
-    for (i = 0; i < len; i++) {
-      _ENC28J60_readDataByte(enc28j60);
-    }
+  len = ENC28J60_receive(enc28j60, frame->data, sizeof(frame->data));
+  if (len == 0) {
+    ENC28J60_frameRelease(frame);
+    return NULL;
   }
+  frame->length = len;
+  return frame;
+}
+
+int ENC28J60_sendFrame(ENC28J60* enc28j60, ENC28J60_Frame* frame) {
+  int r;
 
-  /* Read an additional byte at odd lengths, to avoid FIFO corruption */
-  if ((len % 2) != 0) {
-    _ENC28J60_readDataByte(enc28j60);
+  r = ENC28J60_send(enc28j60, frame->data, frame->length);
+  ENC28J60_frameRelease(frame);
+  return r;
+}
+
+HAL_StatusTypeDef ENC28J60_txBegin(ENC28J60* enc28j60) {
+  if (enc28j60->txBuilding) {
+    return HAL_BUSY;
   }
 
-  /* Errata #14 */
-  next = (nxtpkt[1] << 8) + nxtpkt[0];
-  if (next == RX_BUF_START) {
-    next = RX_BUF_END;
-  } else {
-    next = next - 1;
+  /* The previous frame may still be read out of the slot */
+  _ENC28J60_txWaitIdle(enc28j60);
+
+  enc28j60->txBuilding = 1;
+  enc28j60->txBuildLength = 0;
+  enc28j60->txBuildStart = ENC28J60_MICROS();
+  return HAL_OK;
+}
+
+/* EWRPT is set on every write, ENC28J60_sendAt may have moved it since */
+HAL_StatusTypeDef _ENC28J60_txWriteAt(ENC28J60* enc28j60, uint16_t offset, const uint8_t* data, uint16_t len) {
+  enc28j60->spiStatus = HAL_OK;
+  _ENC28J60_setRegBank(enc28j60, ERXTX_BANK);
+  /* Skip the per packet control byte */
+  _ENC28J60_writeReg16(enc28j60, EWRPTL, TX_BUF_START + 1 + offset);
+  return _ENC28J60_writeData(enc28j60, data, len);
+}
+
+HAL_StatusTypeDef ENC28J60_txAppend(ENC28J60* enc28j60, const uint8_t* data, uint16_t len) {
+  if (!enc28j60->txBuilding || len > ENC28J60_txRemaining(enc28j60)) {
+    return HAL_ERROR;
   }
-  _ENC28J60_writeReg16(enc28j60, ERXRDPTL, next);
+  if (_ENC28J60_txWriteAt(enc28j60, enc28j60->txBuildLength, data, len) != HAL_OK) {
+    enc28j60->spiStats.txAborts++;
+    return HAL_ERROR;
+  }
+  enc28j60->txBuildLength += len;
+  return HAL_OK;
+}
 
-  _ENC28J60_setRegBitField(enc28j60, ECON2, ECON2_PKTDEC);
+HAL_StatusTypeDef ENC28J60_txPatch(ENC28J60* enc28j60, uint16_t offset, const uint8_t* data, uint16_t len) {
+  if (!enc28j60->txBuilding || offset > enc28j60->txBuildLength || len > enc28j60->txBuildLength - offset) {
+    return HAL_ERROR;
+  }
+  if (_ENC28J60_txWriteAt(enc28j60, offset, data, len) != HAL_OK) {
+    enc28j60->spiStats.txAborts++;
+    return HAL_ERROR;
+  }
+  return HAL_OK;
+}
 
-  if (err) {
-    ENC28J60_DEBUG_OUT("rx err: flushed %d\n", len);
+uint16_t ENC28J60_txRemaining(ENC28J60* enc28j60) {
+  if (!enc28j60->txBuilding) {
     return 0;
   }
-  ENC28J60_DEBUG_OUT(
-    "rx: %d: %02x:%02x:%02x:%02x:%02x:%02x\n",
-    len,
-    buffer[0], buffer[1], buffer[2],
-    buffer[3], buffer[4], buffer[5]
-  );
+  return ENC28J60_MAX_TX_LENGTH - enc28j60->txBuildLength;
+}
 
-  enc28j60->receivedPackets++;
-  ENC28J60_DEBUG_OUT("receivedPackets %d\n", enc28j60->receivedPackets);
-  return len;
+/* Sends the frame built since ENC28J60_txBegin the same way
+   ENC28J60_send would. An empty frame is dropped. */
+HAL_StatusTypeDef ENC28J60_txCommit(ENC28J60* enc28j60) {
+  uint8_t control;
+  uint16_t datalen;
+  uint16_t dataend;
+
+  if (!enc28j60->txBuilding) {
+    return HAL_ERROR;
+  }
+  datalen = enc28j60->txBuildLength;
+  if (datalen == 0) {
+    enc28j60->txBuilding = 0;
+    return HAL_OK;
+  }
+
+  while (!_ENC28J60_txFitsBeforeScheduled(enc28j60, datalen)) {
+    ENC28J60_pollScheduled(enc28j60);
+  }
+
+  /* A scheduled frame may have been launched while this one was built */
+  _ENC28J60_txWaitIdle(enc28j60);
+
+  /* Per packet control byte, use the MACON3 settings */
+  control = 0x00;
+  enc28j60->spiStatus = HAL_OK;
+  dataend = TX_BUF_START + datalen;
+  _ENC28J60_setRegBank(enc28j60, ERXTX_BANK);
+  _ENC28J60_writeReg16(enc28j60, EWRPTL, TX_BUF_START);
+  _ENC28J60_writeData(enc28j60, &control, 1);
+  _ENC28J60_txArm(enc28j60, TX_BUF_START, dataend);
+  if (enc28j60->spiStatus != HAL_OK) {
+    /* Keep the frame, the caller may commit again */
+    enc28j60->spiStats.txAborts++;
+    return HAL_ERROR;
+  }
+  enc28j60->txBuilding = 0;
+
+  _ENC28J60_tokenBucketTake(&enc28j60->txShaper, _ENC28J60_wireBytes(datalen));
+  _ENC28J60_waitTxPacing(enc28j60);
+
+  _ENC28J60_txStart(enc28j60, TX_BUF_START, dataend);
+  /* Read back for the tap while the chip sends it */
+  _ENC28J60_txTapChip(enc28j60, TX_BUF_START, datalen);
+  if (_ENC28J60_txWaitIdle(enc28j60) != 0) {
+    return HAL_ERROR;
+  }
+  return HAL_OK;
 }
 
-void ENC28J60_tick(ENC28J60* enc28j60) {
-  if (periodicTimer_hasElapsed(&enc28j60->watchDogTimer)) {
-    ENC28J60_DEBUG_OUT(
-      "test received_packet %d > sentPackets %d\n",
-      enc28j60->receivedPackets,
-      enc28j60->sentPackets
-    );
-    if (enc28j60->receivedPackets <= enc28j60->sentPackets) {
-      ENC28J60_DEBUG_OUT("resetting chip\n");
-      _ENC28J60_reset(enc28j60);
+/* Appends to the frame under construction whatever the producer puts
+   into two alternating chunks, until it returns 0 or the frame is full.
+   With ENC28J60_SPI_DMA the producer fills one chunk while the other is
+   written to the chip. */
+HAL_StatusTypeDef ENC28J60_txStream(ENC28J60* enc28j60, uint8_t* chunks, uint16_t chunkSize, ENC28J60_ChunkProducer producer, void* context) {
+  uint8_t* buffer[2];
+  uint16_t space, n, inFlight;
+  int k;
+
+  if (!enc28j60->txBuilding || chunkSize == 0) {
+    return HAL_ERROR;
+  }
+
+  buffer[0] = chunks;
+  buffer[1] = chunks + ENC28J60_DMA_SIZE(chunkSize);
+  inFlight = 0;
+  k = 0;
+
+  enc28j60->spiStatus = HAL_OK;
+  _ENC28J60_setRegBank(enc28j60, ERXTX_BANK);
+  _ENC28J60_writeReg16(enc28j60, EWRPTL, TX_BUF_START + 1 + enc28j60->txBuildLength);
+  _ENC28J60_spiAssert(enc28j60);
+  _ENC28J60_spiTx(enc28j60, 0x7a);
+
+  while (enc28j60->spiStatus == HAL_OK) {
+    space = ENC28J60_txRemaining(enc28j60) - inFlight;
+    if (space > chunkSize) {
+      space = chunkSize;
     }
-    enc28j60->receivedPackets = 0;
-    enc28j60->sentPackets = 0;
+    n = space > 0 ? producer(context, buffer[k], space) : 0;
+    if (n > space) {
+      n = space;
+    }
+
+    /* Only bytes known to be in the chip count towards the frame */
+    if (inFlight > 0) {
+      if (_ENC28J60_spiWait(enc28j60, NULL, inFlight) != HAL_OK) {
+        break;
+      }
+      enc28j60->txBuildLength += inFlight;
+      inFlight = 0;
+    }
+    if (n == 0) {
+      break;
+    }
+
+    _ENC28J60_spiStart(enc28j60, buffer[k], NULL, n);
+    inFlight = n;
+    k ^= 1;
   }
-}
+  _ENC28J60_spiDeassert(enc28j60);
 
-void _ENC28J60_spiAssert(ENC28J60* enc28j60) {
-  HAL_GPIO_WritePin(enc28j60->csPort, enc28j60->csPin, GPIO_PIN_RESET);
+  if (enc28j60->spiStatus != HAL_OK) {
+    enc28j60->spiStats.txAborts++;
+    return HAL_ERROR;
+  }
+  return HAL_OK;
 }
 
-void _ENC28J60_spiDeassert(ENC28J60* enc28j60) {
-  HAL_GPIO_WritePin(enc28j60->csPort, enc28j60->csPin, GPIO_PIN_SET);
+/* Commits the frame under construction once it has been open for
+   maxAgeUs, so aggregated messages are not held back indefinitely.
+   Returns HAL_BUSY while the frame is younger or empty. */
+HAL_StatusTypeDef ENC28J60_txFlush(ENC28J60* enc28j60, uint32_t maxAgeUs) {
+  if (!enc28j60->txBuilding || enc28j60->txBuildLength == 0) {
+    return HAL_BUSY;
+  }
+  if (ENC28J60_MICROS() - enc28j60->txBuildStart < maxAgeUs) {
+    return HAL_BUSY;
+  }
+  return ENC28J60_txCommit(enc28j60);
 }
 
-uint8_t _ENC28J60_spiTx(ENC28J60* enc28j60, uint8_t value) {
-  uint8_t tx[1];
-  uint8_t rx[1];
-  tx[0] = value;
-  HAL_SPI_TransmitReceive(enc28j60->spi, tx, rx, 1, ENC28J60_SPI_TIMEOUT);
+uint32_t ENC28J60_storeFrame(ENC28J60* enc28j60, const uint8_t* data, uint16_t datalen) {
+  ENC28J60_StoredFrame* frame;
+  ENC28J60_StoredFrame* oldest;
+  uint16_t size, start;
+  uint8_t control;
+  int i;
+
+  size = TX_STORE_FOOTPRINT(datalen);
+  if (datalen == 0 || datalen > ENC28J60_MAX_TX_LENGTH || size > TX_STORE_END - TX_STORE_START) {
+    return 0;
+  }
+
+  /* Make room by dropping the least recently used frames */
+  for (;;) {
+    frame = NULL;
+    oldest = NULL;
+    for (i = 0; i < ENC28J60_TX_STORE_FRAMES; i++) {
+      if (enc28j60->txStore[i].handle == 0) {
+        if (frame == NULL) {
+          frame = &enc28j60->txStore[i];
+        }
+      } else if (oldest == NULL || (int32_t) (enc28j60->txStore[i].lastUse - oldest->lastUse) < 0) {
+        oldest = &enc28j60->txStore[i];
+      }
+    }
+    start = _ENC28J60_storeFindGap(enc28j60, size, NULL);
+    if (frame != NULL && start != 0) {
+      break;
+    }
+    ENC28J60_DEBUG_OUT("tx store: evicted %lu\n", (unsigned long) oldest->handle);
+    oldest->handle = 0;
+    enc28j60->txStoreEvictions++;
+  }
+
+  /* Per packet control byte, use the MACON3 settings */
+  control = 0x00;
+  enc28j60->spiStatus = HAL_OK;
+  _ENC28J60_setRegBank(enc28j60, ERXTX_BANK);
+  _ENC28J60_writeReg16(enc28j60, EWRPTL, start);
+  _ENC28J60_writeData(enc28j60, &control, 1);
+  _ENC28J60_writeData(enc28j60, data, datalen);
+  if (enc28j60->spiStatus != HAL_OK) {
+    enc28j60->spiStats.txAborts++;
+    return 0;
+  }
+
+  /* Handle 0 means no frame */
+  if (++enc28j60->txStoreHandle == 0) {
+    enc28j60->txStoreHandle++;
+  }
+  frame->handle = enc28j60->txStoreHandle;
+  frame->start = start;
+  frame->length = datalen;
+  frame->lastUse = ++enc28j60->txStoreClock;
+  return frame->handle;
+}
+
+/* Sends a retained frame the way ENC28J60_send would, without uploading
+   it again. Returns the frame length, or 0 if the handle was evicted or
+   released or the frame could not be sent. */
+int ENC28J60_sendStored(ENC28J60* enc28j60, uint32_t handle) {
+  ENC28J60_StoredFrame* frame;
+  uint16_t dataend;
+
+  frame = _ENC28J60_findStored(enc28j60, handle);
+  if (frame == NULL) {
+    return 0;
+  }
+  frame->lastUse = ++enc28j60->txStoreClock;
+
+  while (!_ENC28J60_txFitsBeforeScheduled(enc28j60, frame->length)) {
+    ENC28J60_pollScheduled(enc28j60);
+  }
+  _ENC28J60_txWaitIdle(enc28j60);
+
+  enc28j60->spiStatus = HAL_OK;
+  dataend = frame->start + frame->length;
+  _ENC28J60_txArm(enc28j60, frame->start, dataend);
+  if (enc28j60->spiStatus != HAL_OK) {
+    enc28j60->spiStats.txAborts++;
+    return 0;
+  }
+
+  _ENC28J60_tokenBucketTake(&enc28j60->txShaper, _ENC28J60_wireBytes(frame->length));
+  _ENC28J60_waitTxPacing(enc28j60);
+
+  _ENC28J60_txStart(enc28j60, frame->start, dataend);
+  _ENC28J60_txTapChip(enc28j60, frame->start, frame->length);
+  if (_ENC28J60_txWaitIdle(enc28j60) != 0) {
+    return 0;
+  }
+  return frame->length;
+}
+
+void ENC28J60_releaseStored(ENC28J60* enc28j60, uint32_t handle) {
+  ENC28J60_StoredFrame* frame = _ENC28J60_findStored(enc28j60, handle);
+
+  if (frame != NULL) {
+    frame->handle = 0;
+  }
+}
+
+void ENC28J60_storeCapacity(ENC28J60* enc28j60, ENC28J60_StoreCapacity* capacity) {
+  int i;
+
+  capacity->size = TX_STORE_END - TX_STORE_START;
+  capacity->used = 0;
+  capacity->frames = 0;
+  for (i = 0; i < ENC28J60_TX_STORE_FRAMES; i++) {
+    if (enc28j60->txStore[i].handle != 0) {
+      capacity->used += TX_STORE_FOOTPRINT(enc28j60->txStore[i].length);
+      capacity->frames++;
+    }
+  }
+  _ENC28J60_storeFindGap(enc28j60, 0xffff, &capacity->largestFree);
+  capacity->evictions = enc28j60->txStoreEvictions;
+}
+
+ENC28J60_StoredFrame* _ENC28J60_findStored(ENC28J60* enc28j60, uint32_t handle) {
+  int i;
+
+  if (handle == 0) {
+    return NULL;
+  }
+  for (i = 0; i < ENC28J60_TX_STORE_FRAMES; i++) {
+    if (enc28j60->txStore[i].handle == handle) {
+      return &enc28j60->txStore[i];
+    }
+  }
+  return NULL;
+}
+
+/* Free bytes from start up to the next retained frame, 0 if start is
+   inside one */
+uint16_t _ENC28J60_storeGapAt(ENC28J60* enc28j60, uint16_t start) {
+  ENC28J60_StoredFrame* frame;
+  uint16_t end;
+  int i;
+
+  end = TX_STORE_END;
+  for (i = 0; i < ENC28J60_TX_STORE_FRAMES; i++) {
+    frame = &enc28j60->txStore[i];
+    if (frame->handle == 0) {
+      continue;
+    }
+    if (start >= frame->start && start < frame->start + TX_STORE_FOOTPRINT(frame->length)) {
+      return 0;
+    }
+    if (frame->start >= start && frame->start < end) {
+      end = frame->start;
+    }
+  }
+  return end - start;
+}
+
+/* First fit. Gaps can only start at the beginning of the store or right
+   after a retained frame. Returns 0 when nothing fits, which can't be a
+   valid start as the store is at the top of memory. */
+uint16_t _ENC28J60_storeFindGap(ENC28J60* enc28j60, uint16_t size, uint16_t* largest) {
+  uint16_t start, gap, found;
+  int i;
+
+  found = 0;
+  if (largest != NULL) {
+    *largest = 0;
+  }
+  for (i = -1; i < ENC28J60_TX_STORE_FRAMES; i++) {
+    if (i < 0) {
+      start = TX_STORE_START;
+    } else if (enc28j60->txStore[i].handle != 0) {
+      start = enc28j60->txStore[i].start + TX_STORE_FOOTPRINT(enc28j60->txStore[i].length);
+    } else {
+      continue;
+    }
+    gap = _ENC28J60_storeGapAt(enc28j60, start);
+    if (largest != NULL && gap > *largest) {
+      *largest = gap;
+    }
+    if (found == 0 && gap >= size) {
+      found = start;
+    }
+  }
+  return found;
+}
+
+uint8_t ENC28J60_txQueueDepth(ENC28J60* enc28j60, ENC28J60_TxClass txClass) {
+  return enc28j60->txQueues[txClass].count;
+}
+
+uint16_t ENC28J60_txNextLength(ENC28J60* enc28j60) {
+  ENC28J60_TxQueue* queue = _ENC28J60_txNextQueue(enc28j60);
+
+  if (queue == NULL) {
+    return 0;
+  }
+  return queue->entries[queue->head].length;
+}
+
+/* Strict priority, the lowest numbered class with a frame goes next */
+ENC28J60_TxQueue* _ENC28J60_txNextQueue(ENC28J60* enc28j60) {
+  int i;
+
+  for (i = 0; i < ENC28J60_TX_CLASSES; i++) {
+    if (enc28j60->txQueues[i].count > 0) {
+      return &enc28j60->txQueues[i];
+    }
+  }
+  return NULL;
+}
+
+uint16_t _ENC28J60_txUpload(ENC28J60* enc28j60, uint16_t start, const uint8_t* data, uint16_t datalen) {
+  uint16_t dataend;
+
+  /*
+    1. Appropriately program the ETXST pointer to point to an unused
+       location in memory. It will point to the per packet control
+       byte. In the example, it would be programmed to 0120h. It is
+       recommended that an even address be used for ETXST.
+
+    2. Use the WBM SPI command to write the per packet control byte,
+       the destination address, the source MAC address, the
+       type/length and the data payload.
+
+    3. Appropriately program the ETXND pointer. It should point to the
+       last byte in the data payload.  In the example, it would be
+       programmed to 0156h.
+
+    4. Clear EIR.TXIF, set EIE.TXIE and set EIE.INTIE to enable an
+       interrupt when done (if desired).
+
+    5. Start the transmission process by setting
+       ECON1.TXRTS.
+  */
+
+  _ENC28J60_setRegBank(enc28j60, ERXTX_BANK);
+  /* Set up the transmit buffer pointer */
+  _ENC28J60_writeReg16(enc28j60, EWRPTL, start);
+
+  /* Write the transmission control register as the first byte of the
+     output packet. We write 0x00 to indicate that the default
+     configuration (the values in MACON3) will be used.  */
+  _ENC28J60_writeDataByte(enc28j60, 0x00); /* MACON3 */
+
+  _ENC28J60_writeData(enc28j60, data, datalen);
+
+  dataend = start + datalen;
+  return dataend;
+}
+
+/* Points the transmit logic at a frame in chip memory, only allowed
+   while nothing is being sent */
+void _ENC28J60_txArm(ENC28J60* enc28j60, uint16_t start, uint16_t dataend) {
+  enc28j60->txScheduledArmed = 0;
+  _ENC28J60_setRegBank(enc28j60, ERXTX_BANK);
+  _ENC28J60_writeReg16(enc28j60, ETXSTL, start);
+
+  /* Write a pointer to the last data byte. */
+  _ENC28J60_writeReg16(enc28j60, ETXNDL, dataend);
+
+  /* Clear EIR.TXIF */
+  _ENC28J60_clearRegBitField(enc28j60, EIR, EIR_TXIF);
+
+  /* Don't care about interrupts for now */
+}
+
+/* Arms the scheduled frame ahead of its deadline, so launching it is
+   just _ENC28J60_txStart. An SPI error here is left to the launch, which
+   tries again; it doesn't fail the caller's own operation. */
+void _ENC28J60_txArmScheduled(ENC28J60* enc28j60) {
+  HAL_StatusTypeDef status = enc28j60->spiStatus;
+
+  enc28j60->spiStatus = HAL_OK;
+  _ENC28J60_txArm(enc28j60, TX_SCHEDULED_START, enc28j60->txScheduledEnd);
+  enc28j60->txScheduledArmed = enc28j60->spiStatus == HAL_OK;
+  enc28j60->spiStatus = status;
+}
+
+/* Sends the armed frame, a single SPI command */
+void _ENC28J60_txStart(ENC28J60* enc28j60, uint16_t start, uint16_t dataend) {
+  enc28j60->txEdge = 0;
+  _ENC28J60_setRegBitField(enc28j60, ECON1, ECON1_TXRTS);
+  enc28j60->txStartTime = ENC28J60_MICROS();
+  enc28j60->txSequence++;
+  enc28j60->txInFlight = 1;
+  enc28j60->txDataEnd = dataend;
+  enc28j60->txDeadline = _ENC28J60_deadline(_ENC28J60_txTimeout(enc28j60, dataend - start));
+}
+
+HAL_StatusTypeDef ENC28J60_sendAt(ENC28J60* enc28j60, const uint8_t* data, uint16_t datalen, uint32_t deadline) {
+  if (datalen > ENC28J60_MAX_TX_LENGTH) {
+    return HAL_ERROR;
+  }
+  if (enc28j60->txScheduled) {
+    return HAL_BUSY;
+  }
+
+  /* The previous scheduled frame may still be read out of the slot */
+  _ENC28J60_txWaitIdle(enc28j60);
+
+  enc28j60->spiStatus = HAL_OK;
+  enc28j60->txScheduledEnd = _ENC28J60_txUpload(enc28j60, TX_SCHEDULED_START, data, datalen);
+  if (enc28j60->spiStatus != HAL_OK) {
+    enc28j60->spiStats.txAborts++;
+    return HAL_ERROR;
+  }
+
+  enc28j60->txScheduled = 1;
+  enc28j60->txScheduledDeadline = deadline;
+  _ENC28J60_txArmScheduled(enc28j60);
+  return HAL_OK;
+}
+
+/* Launches the scheduled frame once its time has come. Call it from the
+   timer callback for the deadline, which must not preempt another call
+   into the driver, or from the main loop. Returns HAL_OK if the frame was
+   launched. */
+HAL_StatusTypeDef ENC28J60_pollScheduled(ENC28J60* enc28j60) {
+  uint32_t lateness;
+
+  if (!enc28j60->txScheduled || (int32_t) (ENC28J60_MICROS() - enc28j60->txScheduledDeadline) < 0) {
+    return HAL_BUSY;
+  }
+  if (enc28j60->txInFlight && _ENC28J60_txPoll(enc28j60) == ENC28J60_TX_BUSY) {
+    return HAL_BUSY;
+  }
+
+  /* Armed since the upload or since the last frame left, unless arming
+     failed or another frame was armed and not yet collected */
+  if (!enc28j60->txScheduledArmed) {
+    enc28j60->spiStatus = HAL_OK;
+    _ENC28J60_txArmScheduled(enc28j60);
+    if (!enc28j60->txScheduledArmed) {
+      /* Past its time already, drop it rather than launch something else */
+      ENC28J60_DEBUG_OUT("tx err: spi error arming scheduled frame\n");
+      enc28j60->spiStats.txAborts++;
+      enc28j60->txScheduled = 0;
+      return HAL_ERROR;
+    }
+  }
+
+  _ENC28J60_txStart(enc28j60, TX_SCHEDULED_START, enc28j60->txScheduledEnd);
+  enc28j60->txScheduled = 0;
+
+  lateness = ENC28J60_MICROS() - enc28j60->txScheduledDeadline;
+  if (lateness > enc28j60->txStats.maxScheduledLateness) {
+    enc28j60->txStats.maxScheduledLateness = lateness;
+  }
+
+  /* Tapped once it is on its way, not when it was uploaded */
+  _ENC28J60_txTapChip(enc28j60, TX_SCHEDULED_START, enc28j60->txScheduledEnd - TX_SCHEDULED_START);
+  return HAL_OK;
+}
+
+/* Whether a frame started now is off the wire before the scheduled one
+   has to go */
+uint8_t _ENC28J60_txFitsBeforeScheduled(ENC28J60* enc28j60, uint16_t datalen) {
+  uint32_t end;
+
+  if (!enc28j60->txScheduled) {
+    return 1;
+  }
+  end = ENC28J60_MICROS() + _ENC28J60_wireTime(datalen) + ENC28J60_MICROS_RESOLUTION;
+  return (int32_t) (enc28j60->txScheduledDeadline - end) > 0;
+}
+
+/* Checks on the frame in flight, and once it has left collects its
+   status. Returns ENC28J60_TX_BUSY while it is still being sent. */
+int _ENC28J60_txPoll(ENC28J60* enc28j60) {
+  uint8_t tsv[TSV_LENGTH];
+  uint8_t aborted;
+  uint32_t now;
+
+  if (!enc28j60->txInFlight) {
+    return ENC28J60_TX_IDLE;
+  }
+
+  if ((_ENC28J60_readReg(enc28j60, ECON1) & ECON1_TXRTS) > 0) {
+    /* Pause frames read since the start count too */
+    if (!_ENC28J60_deadlinePassed(enc28j60->txDeadline + enc28j60->txPauseAllowance)) {
+      return ENC28J60_TX_BUSY;
+    }
+    ENC28J60_DEBUG_OUT("timeout sending packet\n");
+    _ENC28J60_clearRegBitField(enc28j60, ECON1, ECON1_TXRTS);
+    enc28j60->txInFlight = 0;
+    enc28j60->txStats.timeouts++;
+    memset(tsv, 0, sizeof(tsv));
+    _ENC28J60_txRecord(enc28j60, ENC28J60_TX_STATUS_TIMEOUT, tsv, ENC28J60_MICROS());
+    if (enc28j60->txScheduled) {
+      _ENC28J60_txArmScheduled(enc28j60);
+    }
+    return ENC28J60_TX_TIMEOUT;
+  }
+  now = ENC28J60_MICROS();
+  enc28j60->txInFlight = 0;
+  enc28j60->lastTxTime = now;
+
+  /* Collisions and deferrals only happen in half duplex, so in full
+     duplex the status vector is only fetched when the frame was aborted
+     or timestamps want it. */
+  aborted = (_ENC28J60_readReg(enc28j60, ESTAT) & ESTAT_TXABRT) != 0;
+  if (aborted || !enc28j60->macTiming.fullDuplex || enc28j60->txTimestamping) {
+    _ENC28J60_readTsv(enc28j60, enc28j60->txDataEnd, tsv);
+  } else {
+    memset(tsv, 0, sizeof(tsv));
+  }
+  _ENC28J60_updateTxStats(enc28j60, tsv);
+
+  if (aborted) {
+    enc28j60->txStats.aborted++;
+    ENC28J60_DEBUG_OUT("tx err: tsv: %02x%02x%02x%02x%02x%02x%02x\n",
+                       tsv[6], tsv[5], tsv[4], tsv[3], tsv[2], tsv[1], tsv[0]);
+  }
+
+  _ENC28J60_txRecord(enc28j60, aborted ? ENC28J60_TX_STATUS_ABORTED : ENC28J60_TX_STATUS_OK, tsv, now);
+
+  enc28j60->sentPackets++;
+  ENC28J60_DEBUG_OUT("sentPackets %d\n", enc28j60->sentPackets);
+
+  /* The slot is free again, get the scheduled frame ready to go */
+  if (enc28j60->txScheduled) {
+    _ENC28J60_txArmScheduled(enc28j60);
+  }
+  return ENC28J60_TX_IDLE;
+}
+
+/* now is when the poll saw TXRTS cleared. An INT edge caused by the
+   frame is closer to the real completion. */
+void _ENC28J60_txRecord(ENC28J60* enc28j60, uint8_t status, const uint8_t* tsv, uint32_t now) {
+  ENC28J60_TxTimestamp* record = &enc28j60->txLast;
+
+  if (!enc28j60->txTimestamping) {
+    return;
+  }
+
+  record->sequence = enc28j60->txSequence;
+  record->startTime = enc28j60->txStartTime;
+  record->completionTime = now;
+  if (status != ENC28J60_TX_STATUS_TIMEOUT && _ENC28J60_txEdgeIsCompletion(enc28j60)) {
+    record->completionTime = enc28j60->txEdgeTime;
+  }
+  record->status = status;
+  memcpy(record->tsv, tsv, TSV_LENGTH);
+
+  if (enc28j60->txCompletion != NULL) {
+    enc28j60->txCompletion(enc28j60->txCompletionContext, record);
+  }
+}
+
+void ENC28J60_setTxTimestamps(ENC28J60* enc28j60, uint8_t enable, ENC28J60_TxCompletion completion, void* context) {
+  enc28j60->txTimestamping = enable;
+  enc28j60->txCompletion = completion;
+  enc28j60->txCompletionContext = context;
+}
+
+/* Only touches two fields, safe to call from the EXTI handler of the INT
+   line while a driver call is running. Which source pulled INT low can't
+   be asked over SPI from here, _ENC28J60_txEdgeIsCompletion checks when
+   the frame is collected. The last edge is kept: an earlier one from
+   another source is followed by the frame's own once INT went high. */
+void ENC28J60_txInterrupt(ENC28J60* enc28j60) {
+  if (enc28j60->txInFlight) {
+    enc28j60->txEdgeTime = ENC28J60_MICROS();
+    enc28j60->txEdge = 1;
+  }
+}
+
+/* The edge marks the end of the frame only if TXIF is set and no other
+   enabled source is pending, which could have pulled INT low instead.
+   TXIF stays set until the next frame is armed or ENC28J60_pollEvents
+   acknowledges it, after the frame is collected. */
+uint8_t _ENC28J60_txEdgeIsCompletion(ENC28J60* enc28j60) {
+  uint8_t eir, others;
+
+  if (!enc28j60->txEdge || (int32_t) (enc28j60->txEdgeTime - enc28j60->txStartTime) < 0) {
+    return 0;
+  }
+  eir = _ENC28J60_readReg(enc28j60, EIR);
+  others = _ENC28J60_interruptEnables(enc28j60->interruptEvents) & (EIR_PKTIF | EIR_LINKIF | EIR_RXERIF);
+  return (eir & EIR_TXIF) != 0 && (eir & others) == 0;
+}
+
+const ENC28J60_TxTimestamp* ENC28J60_lastTxTimestamp(ENC28J60* enc28j60) {
+  return &enc28j60->txLast;
+}
+
+uint32_t ENC28J60_rxTimestamp(ENC28J60* enc28j60) {
+  return enc28j60->rxStartTime;
+}
+
+/* Blocks until the frame in flight, if any, has left. Returns non-zero
+   if it timed out. */
+int _ENC28J60_txWaitIdle(ENC28J60* enc28j60) {
+  int r;
+  while ((r = _ENC28J60_txPoll(enc28j60)) == ENC28J60_TX_BUSY);
+  return r == ENC28J60_TX_TIMEOUT;
+}
+
+/* The chip's word on where the next packet starts is only trusted if it
+   agrees with the length of the current one. A length too short for the
+   CRC is as corrupt as one too long, and rxBegin can't report it. */
+uint8_t _ENC28J60_isValidRxHeader(ENC28J60* enc28j60, uint16_t next, uint16_t len) {
+  uint16_t distance, expected;
+
+  if ((uint16_t) (next - RX_BUF_START) >= RX_BUF_SIZE || (next & 1) != 0) {
+    return 0;
+  }
+  if (len < MIN_RX_LENGTH || len > MAX_MAC_LENGTH) {
+    return 0;
+  }
+
+  distance = (next + RX_BUF_SIZE - enc28j60->rxNextPacket) % RX_BUF_SIZE;
+  expected = (RX_HEADER_LENGTH + len + 1) & ~1;
+  return distance == expected;
+}
+
+/* Throws away everything in the receive buffer and starts over, without
+   touching the MAC, PHY or transmit side. */
+void _ENC28J60_rxResync(ENC28J60* enc28j60) {
+  uint32_t startTime;
+  int i;
+
+  ENC28J60_DEBUG_OUT("rx resync\n");
+  startTime = ENC28J60_MICROS();
+  enc28j60->rxStats.resyncs++;
+
+  _ENC28J60_clearRegBitField(enc28j60, ECON1, ECON1_RXEN);
+  _ENC28J60_setRegBitField(enc28j60, ECON1, ECON1_RXRST);
+  _ENC28J60_clearRegBitField(enc28j60, ECON1, ECON1_RXRST);
+
+  _ENC28J60_writeRxPointers(enc28j60);
+
+  /* Bring EPKTCNT back to zero, it only goes down one packet at a time */
+  _ENC28J60_setRegBank(enc28j60, EPKTCNT_BANK);
+  for (i = 0; i < 255 && _ENC28J60_readReg(enc28j60, EPKTCNT) > 0; i++) {
+    _ENC28J60_setRegBitField(enc28j60, ECON2, ECON2_PKTDEC);
+  }
+  _ENC28J60_clearRegBitField(enc28j60, EIR, EIR_RXERIF);
+
+  _ENC28J60_setRegBitField(enc28j60, ECON1, ECON1_RXEN);
+  enc28j60->spiStatus = HAL_OK;
+  _ENC28J60_recordRecovery(enc28j60, startTime);
+}
+
+/* Consumes a pause frame the MAC honoured. The longest pause asked for
+   is allowed on top of every transmit timeout from then on. */
+void _ENC28J60_rxPause(ENC28J60* enc28j60, uint16_t len) {
+  uint8_t frame[PAUSE_HEADER_LENGTH];
+  uint32_t pause;
+
+  if (len >= PAUSE_HEADER_LENGTH && _ENC28J60_readData(enc28j60, frame, sizeof(frame)) == HAL_OK &&
+      ((frame[12] << 8) | frame[13]) == ETHERTYPE_MAC_CONTROL && ((frame[14] << 8) | frame[15]) == PAUSE_OPCODE) {
+    enc28j60->rxStats.pauseFrames++;
+    pause = (((frame[16] << 8) | frame[17]) * (uint32_t) SLOT_TIME_NS) / 1000;
+    if (pause > ENC28J60_TX_PAUSE_MAX_US) {
+      pause = ENC28J60_TX_PAUSE_MAX_US;
+    }
+    if (pause > enc28j60->txPauseAllowance) {
+      enc28j60->txPauseAllowance = pause;
+    }
+  }
+  enc28j60->spiStatus = HAL_OK;
+  _ENC28J60_rxFinish(enc28j60, 0);
+}
+
+void _ENC28J60_writeRxPointers(ENC28J60* enc28j60) {
+  _ENC28J60_setRegBank(enc28j60, ERXTX_BANK);
+  _ENC28J60_writeReg16(enc28j60, ERXSTL, RX_BUF_START);
+  _ENC28J60_writeReg16(enc28j60, ERXNDL, RX_BUF_END);
+  _ENC28J60_writeReg16(enc28j60, ERDPTL, RX_BUF_START);
+  _ENC28J60_writeReg16(enc28j60, ERXRDPTL, RX_BUF_END);
+  enc28j60->rxNextPacket = RX_BUF_START;
+  /* A frame being streamed went with the ring */
+  enc28j60->rxOpen = 0;
+}
+
+void ENC28J60_setFrameTap(ENC28J60* enc28j60, ENC28J60_FrameTap tap, void* context) {
+  enc28j60->frameTap = tap;
+  enc28j60->frameTapContext = context;
+}
+
+void ENC28J60_setFrameTapBuffer(ENC28J60* enc28j60, uint8_t* buffer, uint16_t bufsize) {
+  enc28j60->frameTapBuffer = buffer;
+  enc28j60->frameTapBufferSize = bufsize;
+}
+
+/* Called once a frame is armed, so frames whose upload failed are not
+   reported as sent */
+void _ENC28J60_txTap(ENC28J60* enc28j60, const uint8_t* data, uint16_t datalen) {
+  if (enc28j60->frameTap != NULL) {
+    enc28j60->frameTap(enc28j60->frameTapContext, ENC28J60_TAP_TX, data, datalen);
+  }
+}
+
+/* Frames that only exist in chip memory are read back into the tap
+   buffer. A failed read only costs the copy, not the frame. */
+void _ENC28J60_txTapChip(ENC28J60* enc28j60, uint16_t start, uint16_t datalen) {
+  HAL_StatusTypeDef status;
+
+  if (enc28j60->frameTap == NULL || enc28j60->frameTapBuffer == NULL || datalen > enc28j60->frameTapBufferSize) {
+    return;
+  }
+  status = enc28j60->spiStatus;
+  enc28j60->spiStatus = HAL_OK;
+  /* Skip the per packet control byte */
+  if (_ENC28J60_readAt(enc28j60, start + 1, enc28j60->frameTapBuffer, datalen) == HAL_OK) {
+    _ENC28J60_txTap(enc28j60, enc28j60->frameTapBuffer, datalen);
+  }
+  enc28j60->spiStatus = status;
+}
+
+uint16_t ENC28J60_rxBufferUsed(ENC28J60* enc28j60) {
+  uint16_t writePointer, used;
+
+  _ENC28J60_setRegBank(enc28j60, ERXTX_BANK);
+  writePointer = _ENC28J60_readReg(enc28j60, ERXWRPTL);
+  writePointer |= _ENC28J60_readReg(enc28j60, ERXWRPTH) << 8;
+
+  used = (writePointer + RX_BUF_SIZE - enc28j60->rxNextPacket) % RX_BUF_SIZE;
+  if (used > enc28j60->rxStats.bufferHighWater) {
+    enc28j60->rxStats.bufferHighWater = used;
+  }
+  return used;
+}
+
+void ENC28J60_setTxPacing(ENC28J60* enc28j60, uint8_t enable) {
+  enc28j60->txPacing = enable;
+  enc28j60->collisionScore = 0;
+}
+
+void ENC28J60_setRateLimit(ENC28J60* enc28j60, uint32_t bytesPerSecond, uint32_t burstBytes) {
+  _ENC28J60_tokenBucketSetup(&enc28j60->txShaper, bytesPerSecond, burstBytes);
+}
+
+/* Upper bound of how long the chip may take to send a frame: its wire
+   time, and in half duplex every retransmission plus the longest backoff
+   before each of them. In full duplex the pause allowance is added when
+   the deadline is checked. */
+uint32_t _ENC28J60_txTimeout(ENC28J60* enc28j60, uint16_t datalen) {
+  uint32_t wireTime, timeout;
+  uint8_t attempt, exponent;
+
+  wireTime = _ENC28J60_wireTime(datalen);
+  timeout = wireTime + ENC28J60_TX_TIMEOUT_MARGIN_US;
+  if (!enc28j60->macTiming.fullDuplex) {
+    for (attempt = 1; attempt <= enc28j60->macTiming.maxRetransmissions; attempt++) {
+      exponent = attempt < 10 ? attempt : 10;
+      timeout += wireTime + ((((uint32_t) 1 << exponent) - 1) * SLOT_TIME_NS) / 1000;
+    }
+  }
+  return timeout;
+}
+
+uint32_t _ENC28J60_wireTime(uint16_t datalen) {
+  return ((uint32_t) _ENC28J60_wireBytes(datalen) * WIRE_NS_PER_BYTE) / 1000;
+}
+
+uint32_t _ENC28J60_deadline(uint32_t timeoutUs) {
+  return ENC28J60_MICROS() + timeoutUs + ENC28J60_MICROS_RESOLUTION;
+}
+
+/* Wrap safe as long as deadlines are less than 2^31us away */
+uint8_t _ENC28J60_deadlinePassed(uint32_t deadline) {
+  return (int32_t) (ENC28J60_MICROS() - deadline) >= 0;
+}
+
+uint16_t _ENC28J60_wireBytes(uint16_t datalen) {
+  if (datalen < MIN_FRAME_LENGTH) {
+    datalen = MIN_FRAME_LENGTH;
+  }
+  return datalen + WIRE_OVERHEAD;
+}
+
+void _ENC28J60_tokenBucketSetup(ENC28J60_TokenBucket* bucket, uint32_t rate, uint32_t burst) {
+  bucket->rate = rate;
+  bucket->burst = burst;
+  bucket->tokens = burst;
+  bucket->lastRefill = ENC28J60_MICROS();
+}
+
+void _ENC28J60_tokenBucketRefill(ENC28J60_TokenBucket* bucket) {
+  uint32_t now, elapsed;
+  uint64_t added;
+
+  now = ENC28J60_MICROS();
+  elapsed = now - bucket->lastRefill;
+  added = ((uint64_t) elapsed * bucket->rate) / 1000000;
+  if (added == 0) {
+    return;
+  }
+
+  if ((int64_t) bucket->tokens + (int64_t) added >= (int64_t) bucket->burst) {
+    bucket->tokens = bucket->burst;
+    bucket->lastRefill = now;
+  } else {
+    bucket->tokens += (int32_t) added;
+    /* Only consume the time that produced whole tokens so the rate does
+       not drift down from rounding */
+    bucket->lastRefill += (uint32_t) ((added * 1000000) / bucket->rate);
+  }
+}
+
+/* Takes the tokens for the frame if the bucket holds enough of them */
+uint8_t _ENC28J60_tokenBucketTryTake(ENC28J60_TokenBucket* bucket, uint16_t bytes) {
+  if (bucket->rate == 0) {
+    return 1;
+  }
+
+  _ENC28J60_tokenBucketRefill(bucket);
+  if (bucket->tokens < bytes && bucket->tokens < (int32_t) bucket->burst) {
+    return 0;
+  }
+  bucket->tokens -= bytes;
+  return 1;
+}
+
+/* Blocks until the bucket holds enough tokens for the frame. A frame
+   larger than the burst goes out once the bucket is full. */
+void _ENC28J60_tokenBucketTake(ENC28J60_TokenBucket* bucket, uint16_t bytes) {
+  if (bucket->rate == 0) {
+    return;
+  }
+
+  _ENC28J60_tokenBucketRefill(bucket);
+  while (bucket->tokens < bytes && bucket->tokens < (int32_t) bucket->burst) {
+    _ENC28J60_tokenBucketRefill(bucket);
+  }
+  bucket->tokens -= bytes;
+}
+
+void _ENC28J60_readTsv(ENC28J60* enc28j60, uint16_t dataend, uint8_t* tsv) {
+  /* The status vector is written right after the last byte of the frame */
+  _ENC28J60_readAt(enc28j60, dataend + 1, tsv, TSV_LENGTH);
+}
+
+/* Reads chip memory anywhere without disturbing the receive path, which
+   relies on ERDPT */
+HAL_StatusTypeDef _ENC28J60_readAt(ENC28J60* enc28j60, uint16_t address, uint8_t* buf, uint16_t len) {
+  uint16_t erdpt;
+
+  _ENC28J60_setRegBank(enc28j60, ERXTX_BANK);
+  erdpt = (_ENC28J60_readReg(enc28j60, ERDPTH) << 8) | _ENC28J60_readReg(enc28j60, ERDPTL);
+  _ENC28J60_writeReg16(enc28j60, ERDPTL, address);
+  _ENC28J60_readData(enc28j60, buf, len);
+  _ENC28J60_writeReg16(enc28j60, ERDPTL, erdpt);
+  return enc28j60->spiStatus;
+}
+
+HAL_StatusTypeDef ENC28J60_readMemory(ENC28J60* enc28j60, uint16_t address, uint8_t* buf, uint16_t len) {
+  enc28j60->spiStatus = HAL_OK;
+  return _ENC28J60_readAt(enc28j60, address, buf, len);
+}
+
+void _ENC28J60_updateTxStats(ENC28J60* enc28j60, const uint8_t* tsv) {
+  ENC28J60_TxStats* stats = &enc28j60->txStats;
+  uint16_t collisions;
+
+  collisions = tsv[2] & TSV2_COLLISION_COUNT;
+  stats->collisions[collisions]++;
+  if (tsv[3] & TSV3_PACKET_DEFER) {
+    stats->deferred++;
+  }
+  if (tsv[3] & TSV3_EXCESSIVE_DEFER) {
+    stats->excessiveDefers++;
+  }
+  if (tsv[3] & TSV3_EXCESSIVE_COLLISION) {
+    stats->excessiveCollisions++;
+    collisions = 16;
+  }
+  if (tsv[3] & TSV3_LATE_COLLISION) {
+    stats->lateCollisions++;
+    collisions = 16;
+  }
+
+  /* Moving average of collisions per frame in 8.8 fixed point */
+  enc28j60->collisionScore = enc28j60->collisionScore
+                             - (enc28j60->collisionScore >> 3)
+                             + ((collisions << 8) >> 3);
+}
+
+uint32_t _ENC28J60_txPacingGap(ENC28J60* enc28j60) {
+  uint32_t gap;
+
+  if (!enc28j60->txPacing) {
+    return 0;
+  }
+
+  gap = ((uint32_t) enc28j60->collisionScore * ENC28J60_TX_PACING_STEP_US) >> 8;
+  if (gap > ENC28J60_TX_PACING_MAX_US) {
+    gap = ENC28J60_TX_PACING_MAX_US;
+  }
+  return gap;
+}
+
+void _ENC28J60_waitTxPacing(ENC28J60* enc28j60) {
+  uint32_t gap = _ENC28J60_txPacingGap(enc28j60);
+  while ((uint32_t) (ENC28J60_MICROS() - enc28j60->lastTxTime) < gap);
+}
+
+int ENC28J60_rxBegin(ENC28J60* enc28j60) {
+  int n, len, next;
+
+  /* Next packet pointer, byte count and receive status */
+  uint8_t header[6];
+  uint8_t destination[MAC_ADDRESS_LENGTH];
+
+  if (enc28j60->rxOpen) {
+    return enc28j60->rxLength;
+  }
+
+  enc28j60->spiStatus = HAL_OK;
+
+  _ENC28J60_setRegBank(enc28j60, EPKTCNT_BANK);
+  n = _ENC28J60_readReg(enc28j60, EPKTCNT);
+
+  if (n == 0 || enc28j60->spiStatus != HAL_OK) {
+    return 0;
+  }
+
+  ENC28J60_DEBUG_OUT("EPKTCNT 0x%02x\n", n);
+
+  enc28j60->rxStartTime = ENC28J60_MICROS();
+  if (n > enc28j60->rxStats.pendingHighWater) {
+    enc28j60->rxStats.pendingHighWater = n;
+  }
+  /* Only pay for the fill level when a backlog is building up */
+  if (n > 1) {
+    ENC28J60_rxBufferUsed(enc28j60);
+  }
+
+  _ENC28J60_setRegBank(enc28j60, ERXTX_BANK);
+  if (_ENC28J60_readData(enc28j60, header, sizeof(header)) != HAL_OK) {
+    /* Nothing has been freed yet, rewind and read the header again on the
+       next call */
+    ENC28J60_DEBUG_OUT("rx err: spi error reading header\n");
+    enc28j60->spiStats.rxAborts++;
+    enc28j60->spiStatus = HAL_OK;
+    _ENC28J60_writeReg16(enc28j60, ERDPTL, enc28j60->rxNextPacket);
+    return 0;
+  }
+
+  ENC28J60_DEBUG_OUT("nxtpkt 0x%02x%02x\n", header[1], header[0]);
+  ENC28J60_DEBUG_OUT("length 0x%02x%02x\n", header[3], header[2]);
+  ENC28J60_DEBUG_OUT("status 0x%02x%02x\n", header[5], header[4]);
+
+  next = (header[1] << 8) + header[0];
+  len = (header[3] << 8) + header[2];
+
+  if (!_ENC28J60_isValidRxHeader(enc28j60, next, len)) {
+    ENC28J60_DEBUG_OUT("rx err: bad header at 0x%04x\n", enc28j60->rxNextPacket);
+    enc28j60->rxStats.badHeaders++;
+    _ENC28J60_rxResync(enc28j60);
+    return 0;
+  }
+
+  enc28j60->rxOpen = 1;
+  enc28j60->rxError = 0;
+  enc28j60->rxFrameNext = next;
+  enc28j60->rxLength = len;
+  enc28j60->rxOffset = 0;
+
+  if (header[5] & RSV_PAUSE_FRAME) {
+    _ENC28J60_rxPause(enc28j60, len);
+    return 0;
+  }
+  /* Other multicast frames only get past the pattern match filter by
+     chance, or the hash table filter which checks them below */
+  if ((header[5] & (RSV_MULTICAST | RSV_BROADCAST)) == RSV_MULTICAST && enc28j60->extraMacCount == 0) {
+    enc28j60->filteredPackets++;
+    _ENC28J60_rxFinish(enc28j60, 0);
+    return 0;
+  }
+
+  /* The hash table filter lets through every frame whose destination
+     falls in the same bucket as one of the extra addresses. Peek at the
+     destination and drop the frame without reading the payload if it is
+     not for us. */
+  if (enc28j60->extraMacCount > 0) {
+    if (len < MAC_ADDRESS_LENGTH) {
+      ENC28J60_DEBUG_OUT("rx err: runt %d\n", len);
+      _ENC28J60_rxFinish(enc28j60, 0);
+      return 0;
+    }
+    if (_ENC28J60_readData(enc28j60, destination, MAC_ADDRESS_LENGTH) != HAL_OK) {
+      ENC28J60_DEBUG_OUT("rx err: spi error reading destination\n");
+      enc28j60->spiStats.rxAborts++;
+      enc28j60->spiStatus = HAL_OK;
+      _ENC28J60_rxFinish(enc28j60, 0);
+      return 0;
+    }
+    if (!_ENC28J60_acceptDestination(enc28j60, destination)) {
+      ENC28J60_DEBUG_OUT(
+        "rx filtered: %02x:%02x:%02x:%02x:%02x:%02x\n",
+        destination[0], destination[1], destination[2],
+        destination[3], destination[4], destination[5]
+      );
+      enc28j60->filteredPackets++;
+      _ENC28J60_rxFinish(enc28j60, 0);
+      return 0;
+    }
+
+    /* Rewind to the start of the frame, ERDPT wraps inside the ring */
+    _ENC28J60_writeReg16(enc28j60, ERDPTL, _ENC28J60_rxAddress(enc28j60, 0));
+  }
+
+  return len;
+}
+
+uint16_t ENC28J60_rxRead(ENC28J60* enc28j60, uint8_t* chunk, uint16_t n) {
+  uint16_t remaining;
+
+  if (!enc28j60->rxOpen || enc28j60->rxError) {
+    return 0;
+  }
+
+  remaining = enc28j60->rxLength - enc28j60->rxOffset;
+  if (n > remaining) {
+    n = remaining;
+  }
+  if (n == 0) {
+    return 0;
+  }
+
+  enc28j60->spiStatus = HAL_OK;
+  _ENC28J60_setRegBank(enc28j60, ERXTX_BANK);
+  if (_ENC28J60_readData(enc28j60, chunk, n) != HAL_OK) {
+    /* The rest of the frame is unusable, rxEnd drops it */
+    ENC28J60_DEBUG_OUT("rx err: spi error reading payload\n");
+    enc28j60->spiStats.rxAborts++;
+    enc28j60->spiStatus = HAL_OK;
+    enc28j60->rxError = 1;
+    return 0;
+  }
+  enc28j60->rxOffset += n;
+  return n;
+}
+
+/* Reads the rest of the open frame into two alternating chunks. With
+   ENC28J60_SPI_DMA the next chunk is transferred while the consumer
+   works on the previous one. */
+int ENC28J60_rxStream(ENC28J60* enc28j60, uint8_t* chunks, uint16_t chunkSize, ENC28J60_ChunkConsumer consumer, void* context) {
+  uint8_t* buffer[2];
+  uint16_t length[2];
+  uint16_t remaining;
+  int done, k;
+
+  if (!enc28j60->rxOpen || enc28j60->rxError || chunkSize == 0) {
+    return 0;
+  }
+  remaining = enc28j60->rxLength - enc28j60->rxOffset;
+  if (remaining == 0) {
+    return 0;
+  }
+
+  /* Each chunk owns its cache lines, invalidating one for a DMA read
+     can't throw away what the CPU put in the other */
+  buffer[0] = chunks;
+  buffer[1] = chunks + ENC28J60_DMA_SIZE(chunkSize);
+  done = 0;
+  k = 0;
+
+  enc28j60->spiStatus = HAL_OK;
+  _ENC28J60_spiAssert(enc28j60);
+  /* One RBM command for the whole frame, ERDPT advances by itself */
+  _ENC28J60_spiTx(enc28j60, 0x3a);
+
+  length[k] = remaining < chunkSize ? remaining : chunkSize;
+  remaining -= length[k];
+  _ENC28J60_spiStart(enc28j60, NULL, buffer[k], length[k]);
+
+  while (length[k] > 0) {
+    if (_ENC28J60_spiWait(enc28j60, buffer[k], length[k]) != HAL_OK) {
+      break;
+    }
+
+    length[k ^ 1] = remaining < chunkSize ? remaining : chunkSize;
+    remaining -= length[k ^ 1];
+    if (length[k ^ 1] > 0) {
+      _ENC28J60_spiStart(enc28j60, NULL, buffer[k ^ 1], length[k ^ 1]);
+    }
+
+    consumer(context, buffer[k], length[k]);
+    done += length[k];
+    k ^= 1;
+  }
+  _ENC28J60_spiDeassert(enc28j60);
+
+  enc28j60->rxOffset += done;
+  if (enc28j60->spiStatus != HAL_OK) {
+    /* The rest of the frame is unusable, rxEnd drops it */
+    ENC28J60_DEBUG_OUT("rx err: spi error streaming payload\n");
+    enc28j60->spiStats.rxAborts++;
+    enc28j60->spiStatus = HAL_OK;
+    enc28j60->rxError = 1;
+  }
+  return done;
+}
+
+/* Ring address of a byte of the open frame */
+uint16_t _ENC28J60_rxAddress(ENC28J60* enc28j60, uint16_t offset) {
+  uint32_t address = (uint32_t) enc28j60->rxNextPacket + RX_HEADER_LENGTH + offset;
+
+  if (address > RX_BUF_END) {
+    address -= RX_BUF_SIZE;
+  }
+  return address;
+}
+
+/* Reads anywhere in the open frame, the stream position of rxRead stays
+   where it is */
+HAL_StatusTypeDef ENC28J60_rxPeek(ENC28J60* enc28j60, uint16_t offset, uint8_t* buf, uint16_t len) {
+  if (!enc28j60->rxOpen || offset > enc28j60->rxLength || len > enc28j60->rxLength - offset) {
+    return HAL_ERROR;
+  }
+  enc28j60->spiStatus = HAL_OK;
+  return _ENC28J60_readAt(enc28j60, _ENC28J60_rxAddress(enc28j60, offset), buf, len);
+}
+
+/* Copies part of the open frame to chip memory with the chip's own DMA,
+   so the data never crosses the SPI bus. The copy wraps around the end
+   of the ring like the frame does. */
+HAL_StatusTypeDef ENC28J60_rxCopy(ENC28J60* enc28j60, uint16_t offset, uint16_t len, uint16_t destination) {
+  uint32_t deadline;
+
+  if (!enc28j60->rxOpen || len == 0 || offset > enc28j60->rxLength || len > enc28j60->rxLength - offset) {
+    return HAL_ERROR;
+  }
+
+  enc28j60->spiStatus = HAL_OK;
+  _ENC28J60_setRegBank(enc28j60, ERXTX_BANK);
+  _ENC28J60_writeReg16(enc28j60, EDMASTL, _ENC28J60_rxAddress(enc28j60, offset));
+  _ENC28J60_writeReg16(enc28j60, EDMANDL, _ENC28J60_rxAddress(enc28j60, offset + len - 1));
+  _ENC28J60_writeReg16(enc28j60, EDMADSTL, destination);
+
+  /* CSUMEN would turn the copy into a checksum calculation */
+  _ENC28J60_clearRegBitField(enc28j60, ECON1, ECON1_CSUMEN);
+  _ENC28J60_setRegBitField(enc28j60, ECON1, ECON1_DMAST);
+
+  deadline = _ENC28J60_deadline(ENC28J60_DMA_TIMEOUT_US);
+  while (_ENC28J60_readReg(enc28j60, ECON1) & ECON1_DMAST) {
+    if (enc28j60->spiStatus != HAL_OK) {
+      break;
+    }
+    if (_ENC28J60_deadlinePassed(deadline)) {
+      ENC28J60_DEBUG_OUT("rx err: dma copy timeout\n");
+      _ENC28J60_clearRegBitField(enc28j60, ECON1, ECON1_DMAST);
+      return HAL_TIMEOUT;
+    }
+  }
+  return enc28j60->spiStatus;
+}
+
+void ENC28J60_rxEnd(ENC28J60* enc28j60) {
+  _ENC28J60_rxFinish(enc28j60, !enc28j60->rxError);
+}
+
+/* Frees the ring space of the open frame, whether or not it was read */
+void _ENC28J60_rxFinish(ENC28J60* enc28j60, uint8_t delivered) {
+  uint16_t next;
+
+  if (!enc28j60->rxOpen) {
+    return;
+  }
+  enc28j60->rxOpen = 0;
+
+  /* Seeking also covers the padding byte after odd length frames */
+  next = enc28j60->rxFrameNext;
+  _ENC28J60_setRegBank(enc28j60, ERXTX_BANK);
+  _ENC28J60_writeReg16(enc28j60, ERDPTL, next);
+  enc28j60->rxNextPacket = next;
+
+  /* Errata #14 */
+  if (next == RX_BUF_START) {
+    next = RX_BUF_END;
+  } else {
+    next = next - 1;
+  }
+  _ENC28J60_writeReg16(enc28j60, ERXRDPTL, next);
+
+  _ENC28J60_setRegBitField(enc28j60, ECON2, ECON2_PKTDEC);
+  enc28j60->rxStats.busyTime += ENC28J60_MICROS() - enc28j60->rxStartTime;
+
+  if (!delivered) {
+    enc28j60->rxStats.dropped++;
+    return;
+  }
+  enc28j60->rxStats.delivered++;
+  enc28j60->receivedPackets++;
+  ENC28J60_DEBUG_OUT("receivedPackets %d\n", enc28j60->receivedPackets);
+}
+
+int ENC28J60_receive(ENC28J60* enc28j60, uint8_t* buffer, uint16_t bufsize) {
+  int len;
+
+  len = ENC28J60_rxBegin(enc28j60);
+  if (len == 0) {
+    return 0;
+  }
+
+  if (bufsize < len) {
+    /* Skip the frame, rxEnd moves the read pointer to the next packet */
+    ENC28J60_DEBUG_OUT("rx err: skipped %d\n", len);
+    _ENC28J60_rxFinish(enc28j60, 0);
+    return 0;
+  }
+
+  if (ENC28J60_rxRead(enc28j60, buffer, len) != len) {
+    ENC28J60_rxEnd(enc28j60);
+    return 0;
+  }
+  ENC28J60_rxEnd(enc28j60);
+
+  if (enc28j60->frameTap != NULL) {
+    enc28j60->frameTap(enc28j60->frameTapContext, ENC28J60_TAP_RX, buffer, len);
+  }
+  ENC28J60_DEBUG_OUT(
+    "rx: %d: %02x:%02x:%02x:%02x:%02x:%02x\n",
+    len,
+    buffer[0], buffer[1], buffer[2],
+    buffer[3], buffer[4], buffer[5]
+  );
+  return len;
+}
+
+HAL_StatusTypeDef ENC28J60_setMacTiming(ENC28J60* enc28j60, const ENC28J60_MacTiming* timing) {
+  uint8_t minBackToBackGap;
+
+  minBackToBackGap = timing->fullDuplex ? MABBIPG_MIN_FULL_DUPLEX : MABBIPG_MIN_HALF_DUPLEX;
+  if (timing->backToBackGap < minBackToBackGap || timing->backToBackGap > 0x7f) {
+    return HAL_ERROR;
+  }
+  if (timing->nonBackToBackGapLow < MAIPGL_MIN || timing->nonBackToBackGapLow > 0x7f) {
+    return HAL_ERROR;
+  }
+  if (timing->nonBackToBackGapHigh > 0x7f) {
+    return HAL_ERROR;
+  }
+  if (timing->maxRetransmissions > 0x0f || timing->collisionWindow > 0x3f) {
+    return HAL_ERROR;
+  }
+
+  enc28j60->macTiming = *timing;
+  _ENC28J60_writeMacTiming(enc28j60);
+  /* Pause frames are only let in, and honoured, in full duplex */
+  _ENC28J60_writeReceiveFilters(enc28j60);
+  if (!timing->fullDuplex) {
+    enc28j60->txPauseAllowance = 0;
+  }
+  return HAL_OK;
+}
+
+void _ENC28J60_writeMacTiming(ENC28J60* enc28j60) {
+  const ENC28J60_MacTiming* timing = &enc28j60->macTiming;
+
+  _ENC28J60_setRegBank(enc28j60, MACONX_BANK);
+  if (timing->fullDuplex) {
+    /* IEEE-defined flow control only works in full duplex */
+    _ENC28J60_setRegBitField(enc28j60, MACON1, MACON1_TXPAUS | MACON1_RXPAUS);
+    _ENC28J60_setRegBitField(enc28j60, MACON3, MACON3_FULDPX);
+  } else {
+    _ENC28J60_clearRegBitField(enc28j60, MACON1, MACON1_TXPAUS | MACON1_RXPAUS);
+    _ENC28J60_clearRegBitField(enc28j60, MACON3, MACON3_FULDPX);
+  }
+
+  /* Set back-to-back inter packet gap */
+  _ENC28J60_writeReg(enc28j60, MABBIPG, timing->backToBackGap);
+
+  /* Set non-back-to-back packet gap */
+  _ENC28J60_writeReg(enc28j60, MAIPGL, timing->nonBackToBackGapLow);
+  _ENC28J60_writeReg(enc28j60, MAIPGH, timing->nonBackToBackGapHigh);
+
+  /* Retransmission and collision window, only used in half duplex */
+  _ENC28J60_writeReg(enc28j60, MACLCON1, timing->maxRetransmissions);
+  _ENC28J60_writeReg(enc28j60, MACLCON2, timing->collisionWindow);
+
+  /* PHCON1.PDPXMD must match MACON3.FULDPX. In half duplex also disable
+     the loopback of transmitted frames. */
+  if (timing->fullDuplex) {
+    _ENC28J60_writePhy(enc28j60, PHCON1, PHCON1_PDPXMD);
+    _ENC28J60_writePhy(enc28j60, PHCON2, 0);
+  } else {
+    _ENC28J60_writePhy(enc28j60, PHCON1, 0);
+    _ENC28J60_writePhy(enc28j60, PHCON2, PHCON2_HDLDIS);
+  }
+}
+
+HAL_StatusTypeDef ENC28J60_addMacAddress(ENC28J60* enc28j60, const uint8_t* macAddress) {
+  int slot;
+
+  slot = _ENC28J60_findMacSlot(enc28j60, macAddress);
+  if (enc28j60->extraMacs[slot].used) {
+    return HAL_OK;
+  }
+  if (enc28j60->extraMacCount >= ENC28J60_EXTRA_MAC_SLOTS / 2) {
+    return HAL_ERROR;
+  }
+
+  enc28j60->extraMacs[slot].used = 1;
+  memcpy(enc28j60->extraMacs[slot].address, macAddress, MAC_ADDRESS_LENGTH);
+  enc28j60->extraMacCount++;
+
+  _ENC28J60_writeReceiveFilters(enc28j60);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef ENC28J60_removeMacAddress(ENC28J60* enc28j60, const uint8_t* macAddress) {
+  ENC28J60_MacSlot remaining[ENC28J60_EXTRA_MAC_SLOTS];
+  int i, slot;
+
+  slot = _ENC28J60_findMacSlot(enc28j60, macAddress);
+  if (!enc28j60->extraMacs[slot].used) {
+    return HAL_ERROR;
+  }
+  enc28j60->extraMacs[slot].used = 0;
+
+  /* Re-insert the remaining entries so no probe chain is broken by the
+     hole we just left. */
+  memcpy(remaining, enc28j60->extraMacs, sizeof(remaining));
+  memset(enc28j60->extraMacs, 0, sizeof(enc28j60->extraMacs));
+  for (i = 0; i < ENC28J60_EXTRA_MAC_SLOTS; i++) {
+    if (remaining[i].used) {
+      enc28j60->extraMacs[_ENC28J60_findMacSlot(enc28j60, remaining[i].address)] = remaining[i];
+    }
+  }
+  enc28j60->extraMacCount--;
+
+  _ENC28J60_writeReceiveFilters(enc28j60);
+  return HAL_OK;
+}
+
+/* Returns the slot holding macAddress, or the empty slot where it belongs. */
+int _ENC28J60_findMacSlot(ENC28J60* enc28j60, const uint8_t* macAddress) {
+  unsigned int hash;
+  int i, slot;
+
+  hash = 0;
+  for (i = 0; i < MAC_ADDRESS_LENGTH; i++) {
+    hash = (hash * 31) + macAddress[i];
+  }
+
+  slot = hash & (ENC28J60_EXTRA_MAC_SLOTS - 1);
+  while (enc28j60->extraMacs[slot].used) {
+    if (memcmp(enc28j60->extraMacs[slot].address, macAddress, MAC_ADDRESS_LENGTH) == 0) {
+      break;
+    }
+    slot = (slot + 1) & (ENC28J60_EXTRA_MAC_SLOTS - 1);
+  }
+  return slot;
+}
+
+uint8_t _ENC28J60_acceptDestination(ENC28J60* enc28j60, const uint8_t* destination) {
+  static const uint8_t broadcast[MAC_ADDRESS_LENGTH] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+  if (memcmp(destination, enc28j60->macAddress, MAC_ADDRESS_LENGTH) == 0) {
+    return 1;
+  }
+  if (memcmp(destination, broadcast, MAC_ADDRESS_LENGTH) == 0) {
+    return 1;
+  }
+  return enc28j60->extraMacs[_ENC28J60_findMacSlot(enc28j60, destination)].used;
+}
+
+/*
+  8.3 Hash Table Filter
+
+  The hash table filter performs a 32-bit CRC over the six destination
+  address bytes in the packet. Bits 28:23 of the CRC are used as a
+  pointer into the bits of the EHT registers.
+*/
+uint8_t _ENC28J60_hashTableBit(const uint8_t* macAddress) {
+  uint32_t crc;
+  uint8_t byte;
+  int i, j;
+
+  crc = 0xffffffff;
+  for (i = 0; i < MAC_ADDRESS_LENGTH; i++) {
+    byte = macAddress[i];
+    for (j = 0; j < 8; j++) {
+      if (((crc >> 31) ^ byte) & 0x01) {
+        crc = (crc << 1) ^ 0x04c11db7;
+      } else {
+        crc = crc << 1;
+      }
+      byte >>= 1;
+    }
+  }
+  return (crc >> 23) & 0x3f;
+}
+
+void _ENC28J60_writeReceiveFilters(ENC28J60* enc28j60) {
+  uint8_t hashTable[8];
+  uint8_t filters;
+  uint8_t bit;
+  int i;
+
+  memset(hashTable, 0, sizeof(hashTable));
+  for (i = 0; i < ENC28J60_EXTRA_MAC_SLOTS; i++) {
+    if (enc28j60->extraMacs[i].used) {
+      bit = _ENC28J60_hashTableBit(enc28j60->extraMacs[i].address);
+      hashTable[bit >> 3] |= 1 << (bit & 0x07);
+    }
+  }
+
+  _ENC28J60_setRegBank(enc28j60, EPKTCNT_BANK);
+  for (i = 0; i < 8; i++) {
+    _ENC28J60_writeReg(enc28j60, EHT0 + i, hashTable[i]);
+  }
+  filters = ERXFCON_UCEN | ERXFCON_CRCEN | ERXFCON_BCEN;
+  if (enc28j60->extraMacCount > 0) {
+    filters |= ERXFCON_HTEN;
+  }
+
+  /* In full duplex the pause frames the MAC honours are let in too, to
+     learn how long a peer holds the transmitter */
+  if (enc28j60->macTiming.fullDuplex) {
+    for (i = 0; i < 8; i++) {
+      _ENC28J60_writeReg(enc28j60, EPMM0 + i, i == 1 ? PAUSE_PATTERN_MASK : 0);
+    }
+    _ENC28J60_writeReg16(enc28j60, EPMCSL, PAUSE_PATTERN_CHECKSUM);
+    _ENC28J60_writeReg16(enc28j60, EPMOL, 0);
+    filters |= ERXFCON_PMEM;
+  }
+  _ENC28J60_writeReg(enc28j60, ERXFCON, filters);
+}
+
+void ENC28J60_enableInterrupts(ENC28J60* enc28j60, uint8_t events) {
+  enc28j60->interruptEvents = events & ENC28J60_EVENTS_ALL;
+  _ENC28J60_writeInterruptEnables(enc28j60);
+}
+
+void _ENC28J60_writeInterruptEnables(ENC28J60* enc28j60) {
+  uint8_t eie;
+
+  /* The link change interrupt has to be enabled in the PHY as well */
+  if (enc28j60->interruptEvents & ENC28J60_EVENT_LINK) {
+    _ENC28J60_writePhy(enc28j60, PHIE, PHIE_PGEIE | PHIE_PLNKIE);
+  } else {
+    _ENC28J60_writePhy(enc28j60, PHIE, 0);
+  }
+
+  eie = _ENC28J60_interruptEnables(enc28j60->interruptEvents);
+  _ENC28J60_writeReg(enc28j60, EIE, eie != 0 ? EIE_INTIE | eie : 0);
+}
+
+/* EIE bits for a mask of ENC28J60_EVENT_* */
+uint8_t _ENC28J60_interruptEnables(uint8_t events) {
+  uint8_t eie = 0;
+
+  if (events & ENC28J60_EVENT_RX) {
+    eie |= EIE_PKTIE;
+  }
+  if (events & ENC28J60_EVENT_TX_DONE) {
+    eie |= EIE_TXIE | EIE_TXERIE;
+  }
+  if (events & ENC28J60_EVENT_LINK) {
+    eie |= EIE_LINKIE;
+  }
+  if (events & ENC28J60_EVENT_RX_ERROR) {
+    eie |= EIE_RXERIE;
+  }
+  return eie;
+}
+
+uint8_t ENC28J60_pollEvents(ENC28J60* enc28j60) {
+  uint8_t eir, events;
+
+  events = 0;
+  eir = _ENC28J60_readReg(enc28j60, EIR);
+
+  /* EIR.PKTIF is not reliable (errata #6), go by EPKTCNT instead */
+  _ENC28J60_setRegBank(enc28j60, EPKTCNT_BANK);
+  if (_ENC28J60_readReg(enc28j60, EPKTCNT) > 0) {
+    events |= ENC28J60_EVENT_RX;
+  }
+
+  if (eir & EIR_RXERIF) {
+    enc28j60->rxStats.overflows++;
+    events |= ENC28J60_EVENT_RX_ERROR;
+  }
+
+  if (enc28j60->txInFlight && _ENC28J60_txPoll(enc28j60) != ENC28J60_TX_BUSY) {
+    events |= ENC28J60_EVENT_TX_DONE;
+  }
+
+  if (eir & EIR_LINKIF) {
+    /* Reading PHIR clears the link interrupt */
+    _ENC28J60_readPhy(enc28j60, PHIR);
+    events |= ENC28J60_EVENT_LINK;
+  }
+
+  if (eir & (EIR_TXIF | EIR_TXERIF | EIR_RXERIF)) {
+    _ENC28J60_clearRegBitField(enc28j60, EIR, eir & (EIR_TXIF | EIR_TXERIF | EIR_RXERIF));
+  }
+  return events;
+}
+
+uint8_t ENC28J60_isLinkUp(ENC28J60* enc28j60) {
+  return (_ENC28J60_readPhy(enc28j60, PHSTAT2) & PHSTAT2_LSTAT) != 0;
+}
+
+/* A single register read: the SPI transfer must succeed, and a chip that
+   is powered and clocked never reads back all ones */
+uint8_t ENC28J60_isHealthy(ENC28J60* enc28j60) {
+  uint8_t estat;
+
+  enc28j60->spiStatus = HAL_OK;
+  estat = _ENC28J60_readReg(enc28j60, ESTAT);
+  return enc28j60->spiStatus == HAL_OK && estat != 0xff && (estat & ESTAT_CLKRDY) != 0;
+}
+
+void _ENC28J60_writeMacAddress(ENC28J60* enc28j60) {
+  _ENC28J60_setRegBank(enc28j60, MAADRX_BANK);
+  _ENC28J60_writeReg(enc28j60, MAADR6, enc28j60->macAddress[5]);
+  _ENC28J60_writeReg(enc28j60, MAADR5, enc28j60->macAddress[4]);
+  _ENC28J60_writeReg(enc28j60, MAADR4, enc28j60->macAddress[3]);
+  _ENC28J60_writeReg(enc28j60, MAADR3, enc28j60->macAddress[2]);
+  _ENC28J60_writeReg(enc28j60, MAADR2, enc28j60->macAddress[1]);
+  _ENC28J60_writeReg(enc28j60, MAADR1, enc28j60->macAddress[0]);
+}
+
+HAL_StatusTypeDef ENC28J60_setMacAddress(ENC28J60* enc28j60, const uint8_t* macAddress) {
+  memcpy(enc28j60->macAddress, macAddress, MAC_ADDRESS_LENGTH);
+  enc28j60->spiStatus = HAL_OK;
+  _ENC28J60_writeMacAddress(enc28j60);
+  return enc28j60->spiStatus;
+}
+
+/* Drops everything waiting to be sent: queued, scheduled, half built and
+   in flight frames. Dropped queued frames count in their queue. */
+void ENC28J60_flushTx(ENC28J60* enc28j60) {
+  ENC28J60_TxQueue* queue;
+  int i;
+
+  for (i = 0; i < ENC28J60_TX_CLASSES; i++) {
+    queue = &enc28j60->txQueues[i];
+    while (queue->count > 0) {
+      ENC28J60_frameRelease(queue->entries[queue->head].frame);
+      queue->head = (queue->head + 1) % ENC28J60_TX_QUEUE_DEPTH;
+      queue->count--;
+      queue->dropped++;
+    }
+  }
+
+  enc28j60->txScheduled = 0;
+  enc28j60->txScheduledArmed = 0;
+  enc28j60->txBuilding = 0;
+  if (enc28j60->txInFlight) {
+    _ENC28J60_clearRegBitField(enc28j60, ECON1, ECON1_TXRTS);
+    enc28j60->txInFlight = 0;
+  }
+}
+
+void ENC28J60_tick(ENC28J60* enc28j60) {
+  ENC28J60_serviceTx(enc28j60);
+
+  /* EIR.RXERIF means a frame was lost to a full buffer or EPKTCNT */
+  if (_ENC28J60_readReg(enc28j60, EIR) & EIR_RXERIF) {
+    enc28j60->rxStats.overflows++;
+    _ENC28J60_clearRegBitField(enc28j60, EIR, EIR_RXERIF);
+  }
+
+  if (periodicTimer_hasElapsed(&enc28j60->watchDogTimer)) {
+    ENC28J60_DEBUG_OUT(
+      "test received_packet %d > sentPackets %d\n",
+      enc28j60->receivedPackets,
+      enc28j60->sentPackets
+    );
+    if (enc28j60->receivedPackets <= enc28j60->sentPackets) {
+      ENC28J60_DEBUG_OUT("resetting chip\n");
+      enc28j60->recoveryStats.watchdogResets++;
+      _ENC28J60_reset(enc28j60);
+    }
+    enc28j60->receivedPackets = 0;
+    enc28j60->sentPackets = 0;
+  }
+}
+
+void _ENC28J60_spiAssert(ENC28J60* enc28j60) {
+  enc28j60->spiStats.transactions++;
+  HAL_GPIO_WritePin(enc28j60->csPort, enc28j60->csPin, GPIO_PIN_RESET);
+}
+
+void _ENC28J60_spiDeassert(ENC28J60* enc28j60) {
+  HAL_GPIO_WritePin(enc28j60->csPort, enc28j60->csPin, GPIO_PIN_SET);
+}
+
+/* Errors are latched in spiStatus, which the register and buffer helpers
+   return, until the operation that started the transfer clears it. */
+uint8_t _ENC28J60_spiTx(ENC28J60* enc28j60, uint8_t value) {
+  HAL_StatusTypeDef status;
+  uint8_t tx[1];
+  uint8_t rx[1];
+  tx[0] = value;
+  status = HAL_SPI_TransmitReceive(enc28j60->spi, tx, rx, 1, ENC28J60_SPI_TIMEOUT);
+  _ENC28J60_spiComplete(enc28j60, status, rx, 1);
   return rx[0];
 }
 
+/* Starts a bulk transfer inside the current transaction, exactly one of
+   tx and rx is given. A DMA transfer runs in the background until
+   _ENC28J60_spiWait, any other is done on return. Reads go through DMA
+   for the whole cache lines they cover, the bytes before those are read
+   here and the bytes after them by _ENC28J60_spiWait. */
+void _ENC28J60_spiStart(ENC28J60* enc28j60, const uint8_t* tx, uint8_t* rx, uint16_t len) {
+#ifdef ENC28J60_SPI_DMA
+  HAL_StatusTypeDef status;
+  uint16_t head, dmaLength;
+
+  dmaLength = _ENC28J60_spiDmaLength(rx, len, &head);
+  if (dmaLength > 0) {
+    if (rx != NULL) {
+      if (head > 0) {
+        _ENC28J60_spiTransfer(enc28j60, NULL, rx, head);
+        if (enc28j60->spiStatus != HAL_OK) {
+          return;
+        }
+      }
+      /* Dirty lines must not be written back over what the DMA brings in */
+      _ENC28J60_cacheInvalidate(rx + head, dmaLength);
+      status = HAL_SPI_Receive_DMA(enc28j60->spi, rx + head, dmaLength);
+    } else {
+      _ENC28J60_cacheClean(tx, len);
+      status = HAL_SPI_Transmit_DMA(enc28j60->spi, (uint8_t*) tx, len);
+    }
+    if (status == HAL_OK) {
+      return;
+    }
+    _ENC28J60_spiComplete(enc28j60, status, rx != NULL ? rx + head : NULL, dmaLength);
+    return;
+  }
+#endif
+
+  _ENC28J60_spiTransfer(enc28j60, tx, rx, len);
+}
+
+/* Waits for the transfer started by _ENC28J60_spiStart with the same
+   arguments */
+HAL_StatusTypeDef _ENC28J60_spiWait(ENC28J60* enc28j60, uint8_t* rx, uint16_t len) {
+#ifdef ENC28J60_SPI_DMA
+  HAL_StatusTypeDef status;
+  uint32_t deadline;
+  uint16_t head, dmaLength;
+
+  /* A transfer that failed to start has already been accounted for */
+  dmaLength = _ENC28J60_spiDmaLength(rx, len, &head);
+  if (dmaLength == 0 || enc28j60->spiStatus != HAL_OK) {
+    return enc28j60->spiStatus;
+  }
+
+  status = HAL_OK;
+  deadline = _ENC28J60_deadline(_ENC28J60_spiTimeout(dmaLength) * 1000);
+  while (HAL_SPI_GetState(enc28j60->spi) != HAL_SPI_STATE_READY) {
+    if (_ENC28J60_deadlinePassed(deadline)) {
+      status = HAL_TIMEOUT;
+      break;
+    }
+  }
+  if (rx == NULL) {
+    _ENC28J60_spiComplete(enc28j60, status, NULL, dmaLength);
+    return enc28j60->spiStatus;
+  }
+
+  /* Drop lines the CPU may have speculatively loaded meanwhile */
+  _ENC28J60_cacheInvalidate(rx + head, dmaLength);
+  _ENC28J60_spiComplete(enc28j60, status, rx + head, dmaLength);
+  if (enc28j60->spiStatus == HAL_OK && head + dmaLength < len) {
+    _ENC28J60_spiTransfer(enc28j60, NULL, rx + head + dmaLength, len - head - dmaLength);
+  }
+#else
+  (void) rx;
+  (void) len;
+#endif
+  return enc28j60->spiStatus;
+}
+
+/* Programmed transfer, done on return */
+void _ENC28J60_spiTransfer(ENC28J60* enc28j60, const uint8_t* tx, uint8_t* rx, uint16_t len) {
+  HAL_StatusTypeDef status;
+
+  /* The chip ignores SI while streaming buffer memory out, so the receive
+     buffer doubles as the dummy bytes */
+  if (rx != NULL) {
+    status = HAL_SPI_Receive(enc28j60->spi, rx, len, _ENC28J60_spiTimeout(len));
+  } else {
+    status = HAL_SPI_Transmit(enc28j60->spi, (uint8_t*) tx, len, _ENC28J60_spiTimeout(len));
+  }
+  _ENC28J60_spiComplete(enc28j60, status, rx, len);
+}
+
+/* Errors are latched in spiStatus like those of single bytes. The fault
+   hook sees the first byte of a bulk read. */
+void _ENC28J60_spiComplete(ENC28J60* enc28j60, HAL_StatusTypeDef status, uint8_t* rx, uint16_t len) {
+  uint8_t dummy = 0;
+
+  if (rx == NULL) {
+    rx = &dummy;
+  }
+  enc28j60->spiStats.bytes += len;
+  ENC28J60_SPI_FAULT_HOOK(enc28j60, status, rx[0]);
+  if (status != HAL_OK) {
+    enc28j60->spiStatus = status;
+    enc28j60->spiStats.errors++;
+  }
+}
+
+/* Bytes of a transfer to move with DMA, 0 for none. Reads only go
+   through DMA into whole cache lines, a line shared with live data would
+   lose that data when it is invalidated; head is set to the bytes before
+   the first whole line. Writes go through DMA as a whole. */
+uint16_t _ENC28J60_spiDmaLength(const uint8_t* rx, uint16_t len, uint16_t* head) {
+  uint16_t dmaLength;
+
+  *head = 0;
+  if (rx != NULL) {
+    *head = (ENC28J60_CACHE_LINE - ((uintptr_t) rx & (ENC28J60_CACHE_LINE - 1))) & (ENC28J60_CACHE_LINE - 1);
+    if (*head >= len) {
+      *head = 0;
+      return 0;
+    }
+    dmaLength = (len - *head) & ~(ENC28J60_CACHE_LINE - 1);
+  } else {
+    dmaLength = len;
+  }
+  if (dmaLength < ENC28J60_SPI_DMA_THRESHOLD) {
+    *head = 0;
+    return 0;
+  }
+  return dmaLength;
+}
+
+/* Cache maintenance on exactly the lines covering [addr, addr + len) */
+void _ENC28J60_cacheClean(const uint8_t* addr, uint16_t len) {
+  uintptr_t start = (uintptr_t) addr & ~(uintptr_t) (ENC28J60_CACHE_LINE - 1);
+  uint32_t size = ENC28J60_DMA_SIZE((uintptr_t) addr - start + len);
+  ENC28J60_CACHE_CLEAN(start, size);
+}
+
+void _ENC28J60_cacheInvalidate(uint8_t* addr, uint16_t len) {
+  uintptr_t start = (uintptr_t) addr & ~(uintptr_t) (ENC28J60_CACHE_LINE - 1);
+  uint32_t size = ENC28J60_DMA_SIZE((uintptr_t) addr - start + len);
+  ENC28J60_CACHE_INVALIDATE(start, size);
+}
+
+/* HAL timeout in milliseconds for a transfer of len bytes */
+uint32_t _ENC28J60_spiTimeout(uint16_t len) {
+  return ENC28J60_SPI_TIMEOUT + len / ENC28J60_SPI_BYTES_PER_MS;
+}
+
 void _ENC28J60_resetAssert(ENC28J60* enc28j60) {
   HAL_GPIO_WritePin(enc28j60->resetPort, enc28j60->resetPin, GPIO_PIN_RESET);
 }
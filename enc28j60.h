@@ -6,14 +6,404 @@
 #include <platform_config.h>
 #include <utils/timer.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #ifndef MAC_ADDRESS_LENGTH
 #  define MAC_ADDRESS_LENGTH 6
 #endif
 
+/* HAL SPI timeout per transfer in milliseconds. A byte takes
+   microseconds, 2 makes sure at least one full tick is waited. */
 #ifndef ENC28J60_SPI_TIMEOUT
-#  define ENC28J60_SPI_TIMEOUT 1000
+#  define ENC28J60_SPI_TIMEOUT 2
+#endif
+
+/* Largest frame received or sent, including the CRC on receive */
+#define ENC28J60_MAX_FRAME_LENGTH 1518
+
+/* Largest frame handed over for sending, the chip appends the CRC */
+#define ENC28J60_MAX_TX_LENGTH (ENC28J60_MAX_FRAME_LENGTH - 4)
+
+/* Last byte of the receive ring, which starts at 0. The 8 KB of chip
+   memory hold, from the bottom, the receive ring, the reserved region,
+   the two 1.5 KB transmit slots and the retained frame store. This must
+   be odd and below ENC28J60_RESERVED_START; the default leaves no room
+   for a reserved region. */
+#ifndef ENC28J60_RX_BUF_END
+#  define ENC28J60_RX_BUF_END 0x0fff
+#endif
+
+/* Number of buffers in an ENC28J60_FramePool */
+#ifndef ENC28J60_FRAME_POOL_SIZE
+#  define ENC28J60_FRAME_POOL_SIZE 4
+#endif
+
+/* Period in milliseconds of the ENC28J60_tick watchdog, which resets the
+   chip when it saw no more packets received than sent in that time */
+#ifndef ENC28J60_WATCHDOG_PERIOD
+#  define ENC28J60_WATCHDOG_PERIOD (30 * 1000)
+#endif
+
+/* Called with the HAL status and received byte of every SPI transfer,
+   the first byte for bulk transfers. Fault-injection builds and chip
+   models can corrupt either to exercise the recovery paths. */
+#ifndef ENC28J60_SPI_FAULT_HOOK
+#  define ENC28J60_SPI_FAULT_HOOK(enc28j60, status, rx)
+#endif
+
+/* Lower bound of the bus speed, used to stretch ENC28J60_SPI_TIMEOUT
+   for bulk transfers. The default is 1 MHz. */
+#ifndef ENC28J60_SPI_BYTES_PER_MS
+#  define ENC28J60_SPI_BYTES_PER_MS 125
+#endif
+
+/* Define ENC28J60_SPI_DMA to move buffer memory transfers of at least
+   ENC28J60_SPI_DMA_THRESHOLD bytes with HAL_SPI_Receive_DMA and
+   HAL_SPI_Transmit_DMA. Completion is polled with HAL_SPI_GetState. */
+#ifndef ENC28J60_SPI_DMA_THRESHOLD
+#  define ENC28J60_SPI_DMA_THRESHOLD 32
+#endif
+
+/* DMA buffers on parts with a data cache, e.g. Cortex-M7. DMA reads only
+   land in whole cache lines: the lines a read covers entirely go through
+   DMA, the bytes before and after them are moved by programmed
+   transfers. ENC28J60_DMA_BUFFER declares a buffer that owns every line
+   it touches, which reads entirely through DMA. ENC28J60_DMA_SECTION places buffers and
+   frame pools in a region the SPI DMA can reach, e.g.
+   __attribute__((section(".axi_sram"))) on H7 where DTCM is out of its
+   reach. */
+#ifndef ENC28J60_CACHE_LINE
+#  define ENC28J60_CACHE_LINE 32
+#endif
+
+#ifndef ENC28J60_DMA_SECTION
+#  define ENC28J60_DMA_SECTION
+#endif
+
+#define ENC28J60_DMA_ALIGN __attribute__((aligned(ENC28J60_CACHE_LINE)))
+#define ENC28J60_DMA_SIZE(size) (((size) + ENC28J60_CACHE_LINE - 1) & ~(ENC28J60_CACHE_LINE - 1))
+#define ENC28J60_DMA_BUFFER(name, size) \
+  ENC28J60_DMA_SECTION ENC28J60_DMA_ALIGN uint8_t name[ENC28J60_DMA_SIZE(size)]
+
+/* Cache maintenance around DMA transfers, given line aligned ranges.
+   Defaults to the CMSIS calls when the part has a data cache and to
+   nothing otherwise. */
+#ifndef ENC28J60_CACHE_CLEAN
+#  if defined(ENC28J60_SPI_DMA) && defined(__DCACHE_PRESENT) && __DCACHE_PRESENT
+#    define ENC28J60_CACHE_CLEAN(addr, size) SCB_CleanDCache_by_Addr((uint32_t*) (addr), (int32_t) (size))
+#  else
+#    define ENC28J60_CACHE_CLEAN(addr, size) ((void) (addr), (void) (size))
+#  endif
 #endif
 
+#ifndef ENC28J60_CACHE_INVALIDATE
+#  if defined(ENC28J60_SPI_DMA) && defined(__DCACHE_PRESENT) && __DCACHE_PRESENT
+#    define ENC28J60_CACHE_INVALIDATE(addr, size) SCB_InvalidateDCache_by_Addr((uint32_t*) (addr), (int32_t) (size))
+#  else
+#    define ENC28J60_CACHE_INVALIDATE(addr, size) ((void) (addr), (void) (size))
+#  endif
+#endif
+
+/* Times a register read is repeated after an SPI error */
+#ifndef ENC28J60_SPI_RETRIES
+#  define ENC28J60_SPI_RETRIES 2
+#endif
+
+/* Free running microsecond clock, wrapping at 32 bits. Override with a
+   hardware timer to get better than millisecond resolution. */
+#ifndef ENC28J60_MICROS
+#  define ENC28J60_MICROS() (HAL_GetTick() * 1000)
+#  define ENC28J60_MICROS_RESOLUTION 1000
+#endif
+
+/* Granularity of ENC28J60_MICROS, added to every timeout so a deadline
+   can't expire early because the clock ticked right after it was set */
+#ifndef ENC28J60_MICROS_RESOLUTION
+#  define ENC28J60_MICROS_RESOLUTION 1
+#endif
+
+/* Time allowed for the oscillator start-up timer, nominally 300us */
+#ifndef ENC28J60_OST_TIMEOUT_US
+#  define ENC28J60_OST_TIMEOUT_US 1000
+#endif
+
+/* Time allowed for an MII operation, nominally 10.24us */
+#ifndef ENC28J60_PHY_TIMEOUT_US
+#  define ENC28J60_PHY_TIMEOUT_US 50
+#endif
+
+/* Slack on top of the wire time of a frame before a transmission is
+   considered stuck. Covers deferral, not flow control. */
+#ifndef ENC28J60_TX_TIMEOUT_MARGIN_US
+#  define ENC28J60_TX_TIMEOUT_MARGIN_US 2000
+#endif
+
+/* In full duplex the MAC honours a peer's PAUSE frames (MACON1.RXPAUS).
+   They are let in and consumed by the driver, and the longest pause
+   asked for so far is added to every transmit timeout, at most this
+   much. The default is the maximum of 0xffff quanta of 512 bit times at
+   10Mbit/s, 3.36s. Until a peer sends one, a transmitter held up by
+   pause frames still in the ring times out. */
+#ifndef ENC28J60_TX_PAUSE_MAX_US
+#  define ENC28J60_TX_PAUSE_MAX_US 3355392
+#endif
+
+/* Adaptive transmit pacing: pause added between sends for every average
+   collision per frame, and the upper bound of that pause. */
+#ifndef ENC28J60_TX_PACING_STEP_US
+#  define ENC28J60_TX_PACING_STEP_US 200
+#endif
+
+#ifndef ENC28J60_TX_PACING_MAX_US
+#  define ENC28J60_TX_PACING_MAX_US 5000
+#endif
+
+/* ENC28J60_pollEvents results */
+#define ENC28J60_EVENT_RX       0x01
+#define ENC28J60_EVENT_TX_DONE  0x02
+#define ENC28J60_EVENT_LINK     0x04
+#define ENC28J60_EVENT_RX_ERROR 0x08
+#define ENC28J60_EVENTS_ALL     0x0f
+
+/* Frames each transmit class can hold before ENC28J60_queue refuses more */
+#ifndef ENC28J60_TX_QUEUE_DEPTH
+#  define ENC28J60_TX_QUEUE_DEPTH 4
+#endif
+
+/* Chip memory at the top of the 8 KB kept for frames retained with
+   ENC28J60_storeFrame, 1 KB holds a frame of up to 1015 bytes. Must be
+   even; the transmit slots move down to make room, lower
+   ENC28J60_RX_BUF_END along with it. */
+#ifndef ENC28J60_TX_STORE_SIZE
+#  define ENC28J60_TX_STORE_SIZE 0x0400
+#endif
+
+/* Chip memory set aside for ENC28J60_rxCopy, e.g. IPv4 reassembly, right
+   below the transmit slots. Must be even; lower ENC28J60_RX_BUF_END to
+   make room. The receive ring, this region and the retained frame store
+   share the 5 KB outside the transmit slots, by default all of it goes
+   to the ring and the store. */
+#ifndef ENC28J60_RESERVED_SIZE
+#  define ENC28J60_RESERVED_SIZE 0
+#endif
+
+#define ENC28J60_RESERVED_END   (0x2000 - ENC28J60_TX_STORE_SIZE - 2 * 0x0600)
+#define ENC28J60_RESERVED_START (ENC28J60_RESERVED_END - ENC28J60_RESERVED_SIZE)
+
+/* Time allowed for an in-chip DMA copy of a full frame, nominally well
+   under 100us */
+#ifndef ENC28J60_DMA_TIMEOUT_US
+#  define ENC28J60_DMA_TIMEOUT_US 1000
+#endif
+
+/* Most frames ENC28J60_storeFrame retains at once, they share the
+   ENC28J60_TX_STORE_SIZE bytes of the store */
+#ifndef ENC28J60_TX_STORE_FRAMES
+#  define ENC28J60_TX_STORE_FRAMES 8
+#endif
+
+/* Number of slots in the extra unicast address table, must be a power of
+   two. At most half of the slots are filled to keep probe chains short. */
+#ifndef ENC28J60_EXTRA_MAC_SLOTS
+#  define ENC28J60_EXTRA_MAC_SLOTS 8
+#endif
+
+typedef struct {
+  uint8_t used;
+  uint8_t address[MAC_ADDRESS_LENGTH];
+} ENC28J60_MacSlot;
+
+/* Inter-packet gap, collision and duplex settings. Gap values are in the
+   units of the MABBIPG/MAIPGL/MAIPGH registers, see section 6.5 of the
+   datasheet. The half duplex only fields are ignored in full duplex. */
+typedef struct {
+  uint8_t fullDuplex;
+  uint8_t backToBackGap;
+  uint8_t nonBackToBackGapLow;
+  uint8_t nonBackToBackGapHigh;
+  uint8_t maxRetransmissions;
+  uint8_t collisionWindow;
+} ENC28J60_MacTiming;
+
+/* Datasheet recommended half duplex settings */
+extern const ENC28J60_MacTiming ENC28J60_MAC_TIMING_STANDARD;
+/* Shortest IEEE compliant gaps in full duplex, the default */
+extern const ENC28J60_MacTiming ENC28J60_MAC_TIMING_FULL_DUPLEX_MIN;
+/* Half duplex with the widest collision window for long cable runs */
+extern const ENC28J60_MacTiming ENC28J60_MAC_TIMING_LONG_CABLE;
+
+/* Transmit status vector counters. collisions[n] counts the frames that
+   saw n collisions before they were sent. maxScheduledLateness is the
+   worst delay in microseconds from an ENC28J60_sendAt deadline to TXRTS
+   being set. With the slot armed beforehand that is the poll latency
+   plus one SPI command. */
+typedef struct {
+  uint32_t collisions[16];
+  uint32_t deferred;
+  uint32_t excessiveDefers;
+  uint32_t excessiveCollisions;
+  uint32_t lateCollisions;
+  uint32_t aborted;
+  uint32_t timeouts;
+  uint32_t maxScheduledLateness;
+} ENC28J60_TxStats;
+
+#define ENC28J60_TSV_LENGTH 7
+
+#define ENC28J60_TX_STATUS_OK      0
+#define ENC28J60_TX_STATUS_ABORTED 1
+#define ENC28J60_TX_STATUS_TIMEOUT 2
+
+/* Completion of a sent frame. sequence counts the frames started, in the
+   order they went to the chip. Times are ENC28J60_MICROS() values:
+   startTime when TXRTS was set, completionTime when the INT edge passed
+   to ENC28J60_txInterrupt or else the poll that saw the frame done. tsv
+   is the raw transmit status vector, zero after a timeout. */
+typedef struct {
+  uint32_t sequence;
+  uint32_t startTime;
+  uint32_t completionTime;
+  uint8_t status;
+  uint8_t tsv[ENC28J60_TSV_LENGTH];
+} ENC28J60_TxTimestamp;
+
+typedef void (*ENC28J60_TxCompletion)(void* context, const ENC28J60_TxTimestamp* timestamp);
+
+/* A frame retained in chip memory, free when handle is 0 */
+typedef struct {
+  uint32_t handle;
+  uint16_t start;
+  uint16_t length;
+  uint32_t lastUse;
+} ENC28J60_StoredFrame;
+
+/* Retained frame store usage in bytes of chip memory. largestFree is
+   the biggest contiguous space, the frame that fits in it without an
+   eviction is 8 bytes shorter. */
+typedef struct {
+  uint16_t size;
+  uint16_t used;
+  uint16_t largestFree;
+  uint8_t frames;
+  uint32_t evictions;
+} ENC28J60_StoreCapacity;
+
+/* Token bucket shaper, rate is in bytes per second and 0 disables it.
+   tokens goes negative when a frame larger than the burst is let out. */
+typedef struct {
+  uint32_t rate;
+  uint32_t burst;
+  int32_t tokens;
+  uint32_t lastRefill;
+} ENC28J60_TokenBucket;
+
+/* Transmit classes in priority order */
+typedef enum {
+  ENC28J60_TX_CONTROL = 0,
+  ENC28J60_TX_REALTIME,
+  ENC28J60_TX_BULK,
+  ENC28J60_TX_CLASSES
+} ENC28J60_TxClass;
+
+struct ENC28J60_FramePool;
+
+/* A frame buffer borrowed from a pool. Whoever holds the pointer owns
+   the frame and hands it on or gives it back with ENC28J60_frameRelease.
+   data is laid out as a DMA buffer, declare pools with
+   ENC28J60_DMA_SECTION to place them. */
+typedef struct ENC28J60_Frame {
+  struct ENC28J60_FramePool* pool;
+  struct ENC28J60_Frame* next;
+  uint16_t length;
+  ENC28J60_DMA_ALIGN uint8_t data[ENC28J60_DMA_SIZE(ENC28J60_MAX_FRAME_LENGTH)];
+} ENC28J60_Frame;
+
+typedef struct ENC28J60_FramePool {
+  ENC28J60_Frame frames[ENC28J60_FRAME_POOL_SIZE];
+  ENC28J60_Frame* free;
+  uint8_t available;
+} ENC28J60_FramePool;
+
+typedef struct {
+  const uint8_t* data;
+  uint16_t length;
+  uint32_t queuedTime;
+  ENC28J60_Frame* frame;
+} ENC28J60_TxEntry;
+
+/* Latencies are in microseconds, from ENC28J60_queue until the frame is
+   handed to the chip. */
+typedef struct {
+  ENC28J60_TxEntry entries[ENC28J60_TX_QUEUE_DEPTH];
+  uint8_t head;
+  uint8_t count;
+  uint8_t maxDepth;
+  uint32_t sent;
+  uint32_t dropped;
+  uint32_t totalLatency;
+  uint32_t maxLatency;
+} ENC28J60_TxQueue;
+
+/* SPI transactions (chip selects) and bytes clocked, transfer failures
+   reported by the HAL, register reads repeated because of them, and
+   frames dropped because their transfer failed. Sample transactions and
+   bytes around a call to see what it costs on the bus. */
+typedef struct {
+  uint32_t transactions;
+  uint32_t bytes;
+  uint32_t errors;
+  uint32_t retries;
+  uint32_t rxAborts;
+  uint32_t txAborts;
+} ENC28J60_SpiStats;
+
+/* Receive counters. delivered and dropped count frames taken out of
+   the ring, overflows the frames the chip had to throw away. The high
+   water marks are the most packets and bytes seen waiting in the ring,
+   busyTime the microseconds spent in ENC28J60_receive. badHeaders and
+   resyncs count corrupt headers and the receive-only resets they caused.
+   pauseFrames counts the PAUSE frames consumed in full duplex. */
+typedef struct {
+  uint32_t delivered;
+  uint32_t dropped;
+  uint32_t overflows;
+  uint8_t pendingHighWater;
+  uint16_t bufferHighWater;
+  uint32_t busyTime;
+  uint32_t badHeaders;
+  uint32_t resyncs;
+  uint32_t pauseFrames;
+} ENC28J60_RxStats;
+
+/* Chip resets, split by cause, and how long in microseconds the last and
+   the slowest reset or receive resync kept the interface down */
+typedef struct {
+  uint32_t resets;
+  uint32_t failedResets;
+  uint32_t watchdogResets;
+  uint32_t lastDuration;
+  uint32_t maxDuration;
+} ENC28J60_RecoveryStats;
+
+#define ENC28J60_TAP_RX 0
+#define ENC28J60_TAP_TX 1
+
+/* Sees a copy of every frame delivered by receive or armed for sending,
+   e.g. to mirror the traffic to a TAP device or a capture. Frames built
+   with ENC28J60_txBegin, retained with ENC28J60_storeFrame or scheduled
+   with ENC28J60_sendAt only exist in chip memory: they are read back
+   into the buffer given to ENC28J60_setFrameTapBuffer, an SPI read per
+   frame, and not seen without one. A scheduled frame is tapped when it
+   is launched, a dropped one never. */
+typedef void (*ENC28J60_FrameTap)(void* context, uint8_t direction, const uint8_t* data, uint16_t length);
+
+/* Chunk callbacks of ENC28J60_rxStream and ENC28J60_txStream. A producer
+   fills at most size bytes and returns how many, 0 ends the stream. */
+typedef void (*ENC28J60_ChunkConsumer)(void* context, const uint8_t* chunk, uint16_t length);
+typedef uint16_t (*ENC28J60_ChunkProducer)(void* context, uint8_t* chunk, uint16_t size);
+
 typedef struct {
   SPI_HandleTypeDef* spi;
   uint8_t macAddress[MAC_ADDRESS_LENGTH];
@@ -25,7 +415,66 @@ typedef struct {
   uint8_t bank;
   int receivedPackets;
   int sentPackets;
+  int filteredPackets;
   PeriodicTimer watchDogTimer;
+  ENC28J60_MacTiming macTiming;
+  ENC28J60_TxStats txStats;
+
+  uint8_t txPacing;
+  uint16_t collisionScore;
+  uint32_t lastTxTime;
+  ENC28J60_TokenBucket txShaper;
+
+  ENC28J60_TxQueue txQueues[ENC28J60_TX_CLASSES];
+  uint8_t txInFlight;
+  uint16_t txDataEnd;
+  uint32_t txDeadline;
+  uint32_t txPauseAllowance;
+
+  uint8_t txScheduled;
+  uint8_t txScheduledArmed;
+  uint16_t txScheduledEnd;
+  uint32_t txScheduledDeadline;
+
+  uint8_t txBuilding;
+  uint16_t txBuildLength;
+  uint32_t txBuildStart;
+
+  uint32_t txSequence;
+  uint32_t txStartTime;
+  volatile uint32_t txEdgeTime;
+  volatile uint8_t txEdge;
+  uint8_t txTimestamping;
+  ENC28J60_TxCompletion txCompletion;
+  void* txCompletionContext;
+  ENC28J60_TxTimestamp txLast;
+
+  ENC28J60_StoredFrame txStore[ENC28J60_TX_STORE_FRAMES];
+  uint32_t txStoreHandle;
+  uint32_t txStoreClock;
+  uint32_t txStoreEvictions;
+
+  uint8_t interruptEvents;
+
+  HAL_StatusTypeDef spiStatus;
+  ENC28J60_SpiStats spiStats;
+  uint16_t rxNextPacket;
+  uint8_t rxOpen;
+  uint8_t rxError;
+  uint16_t rxFrameNext;
+  uint16_t rxLength;
+  uint16_t rxOffset;
+  uint32_t rxStartTime;
+  ENC28J60_RxStats rxStats;
+  ENC28J60_RecoveryStats recoveryStats;
+
+  ENC28J60_FrameTap frameTap;
+  void* frameTapContext;
+  uint8_t* frameTapBuffer;
+  uint16_t frameTapBufferSize;
+
+  ENC28J60_MacSlot extraMacs[ENC28J60_EXTRA_MAC_SLOTS];
+  uint8_t extraMacCount;
 } ENC28J60;
 
 HAL_StatusTypeDef ENC28J60_setup(ENC28J60* enc28j60);
@@ -33,4 +482,127 @@ void ENC28J60_tick(ENC28J60* enc28j60);
 int ENC28J60_send(ENC28J60* enc28j60, const uint8_t* data, uint16_t datalen);
 int ENC28J60_receive(ENC28J60* enc28j60, uint8_t* buffer, uint16_t bufsize);
 
+/* Streams the next received frame in chunks of any size. rxBegin returns
+   the frame length, or 0 if there is none. rxRead returns the bytes
+   copied, 0 at the end of the frame or after an SPI error. rxEnd frees
+   the frame whether or not it was read to the end; a frame cut short by
+   an SPI error counts as dropped. Streamed frames are not passed to the
+   frame tap. */
+int ENC28J60_rxBegin(ENC28J60* enc28j60);
+uint16_t ENC28J60_rxRead(ENC28J60* enc28j60, uint8_t* chunk, uint16_t n);
+void ENC28J60_rxEnd(ENC28J60* enc28j60);
+
+/* Random access to the open frame and to chip memory. rxCopy moves
+   frame bytes into chip memory, normally the reserved region, without
+   an SPI transfer of the data. */
+HAL_StatusTypeDef ENC28J60_rxPeek(ENC28J60* enc28j60, uint16_t offset, uint8_t* buf, uint16_t len);
+HAL_StatusTypeDef ENC28J60_rxCopy(ENC28J60* enc28j60, uint16_t offset, uint16_t len, uint16_t destination);
+HAL_StatusTypeDef ENC28J60_readMemory(ENC28J60* enc28j60, uint16_t address, uint8_t* buf, uint16_t len);
+
+/* Double-buffered versions of rxRead and txAppend. chunks holds two
+   chunks of ENC28J60_DMA_SIZE(chunkSize) bytes each, the second starting
+   right after the first; declare it with
+   ENC28J60_DMA_BUFFER(chunks, 2 * ENC28J60_DMA_SIZE(chunkSize)). With a
+   multiple of ENC28J60_CACHE_LINE for chunkSize every byte is read with
+   DMA. rxStream returns the bytes passed to the consumer. */
+int ENC28J60_rxStream(ENC28J60* enc28j60, uint8_t* chunks, uint16_t chunkSize, ENC28J60_ChunkConsumer consumer, void* context);
+HAL_StatusTypeDef ENC28J60_txStream(ENC28J60* enc28j60, uint8_t* chunks, uint16_t chunkSize, ENC28J60_ChunkProducer producer, void* context);
+
+/* Queued frames are sent from ENC28J60_serviceTx (also run by
+   ENC28J60_tick) without blocking. data must stay valid until the frame
+   has left its queue. Frames longer than ENC28J60_MAX_TX_LENGTH are
+   refused with HAL_ERROR, here and by ENC28J60_sendAt; ENC28J60_send
+   returns 0 for them. */
+HAL_StatusTypeDef ENC28J60_queue(ENC28J60* enc28j60, ENC28J60_TxClass txClass, const uint8_t* data, uint16_t datalen);
+void ENC28J60_serviceTx(ENC28J60* enc28j60);
+uint8_t ENC28J60_txQueueDepth(ENC28J60* enc28j60, ENC28J60_TxClass txClass);
+/* Length of the queued frame ENC28J60_serviceTx sends next, 0 with all
+   queues empty */
+uint16_t ENC28J60_txNextLength(ENC28J60* enc28j60);
+
+/* Uploads a frame into its own transmit slot now and launches it at
+   deadline, an ENC28J60_MICROS() time, from ENC28J60_pollScheduled.
+   Only one frame can be scheduled at a time. It is armed right away and
+   again whenever another frame sent meanwhile is collected, so the
+   launch is a single SPI command. Only when that frame is still to be
+   collected at the deadline, by ENC28J60_pollScheduled itself, does the
+   launch arm the slot first. A frame that can't be armed at its deadline because of an
+   SPI error is dropped. */
+HAL_StatusTypeDef ENC28J60_sendAt(ENC28J60* enc28j60, const uint8_t* data, uint16_t datalen, uint32_t deadline);
+HAL_StatusTypeDef ENC28J60_pollScheduled(ENC28J60* enc28j60);
+
+/* Builds a frame in place in the chip's transmit buffer. Appends fail
+   once the frame would exceed ENC28J60_MAX_TX_LENGTH; txPatch
+   rewrites bytes already appended, e.g. a length field. ENC28J60_send
+   fails and queued frames wait until the frame is committed. */
+HAL_StatusTypeDef ENC28J60_txBegin(ENC28J60* enc28j60);
+HAL_StatusTypeDef ENC28J60_txAppend(ENC28J60* enc28j60, const uint8_t* data, uint16_t len);
+HAL_StatusTypeDef ENC28J60_txPatch(ENC28J60* enc28j60, uint16_t offset, const uint8_t* data, uint16_t len);
+uint16_t ENC28J60_txRemaining(ENC28J60* enc28j60);
+HAL_StatusTypeDef ENC28J60_txCommit(ENC28J60* enc28j60);
+HAL_StatusTypeDef ENC28J60_txFlush(ENC28J60* enc28j60, uint32_t maxAgeUs);
+
+/* Transmit timestamps. Once enabled, every frame that completes or times
+   out updates ENC28J60_lastTxTimestamp and is passed to completion, if
+   any; in full duplex this costs a status vector read per frame. Call
+   ENC28J60_txInterrupt on every falling INT edge for completion times
+   better than the polling interval. The edge is used when EIR shows the
+   frame's TXIF and no other enabled source pending as the frame is
+   collected, otherwise the poll time is. Enable ENC28J60_EVENT_TX_DONE
+   alone to get the edge for every frame. ENC28J60_rxTimestamp is when
+   the last frame was found by ENC28J60_rxBegin or ENC28J60_receive. */
+void ENC28J60_setTxTimestamps(ENC28J60* enc28j60, uint8_t enable, ENC28J60_TxCompletion completion, void* context);
+void ENC28J60_txInterrupt(ENC28J60* enc28j60);
+const ENC28J60_TxTimestamp* ENC28J60_lastTxTimestamp(ENC28J60* enc28j60);
+uint32_t ENC28J60_rxTimestamp(ENC28J60* enc28j60);
+
+/* Retained frames. ENC28J60_storeFrame uploads a frame without sending
+   it and returns its handle, or 0 if it can't be retained; the least
+   recently stored or sent frames are evicted to make room.
+   ENC28J60_sendStored sends it, as often as needed, without another
+   upload. Handles of evicted frames are never reused and a chip reset
+   forgets every frame. */
+uint32_t ENC28J60_storeFrame(ENC28J60* enc28j60, const uint8_t* data, uint16_t datalen);
+int ENC28J60_sendStored(ENC28J60* enc28j60, uint32_t handle);
+void ENC28J60_releaseStored(ENC28J60* enc28j60, uint32_t handle);
+void ENC28J60_storeCapacity(ENC28J60* enc28j60, ENC28J60_StoreCapacity* capacity);
+
+/* Pooled frames. The send and queue functions take ownership of the frame
+   and release it even when they fail, ENC28J60_receiveFrame returns NULL
+   when nothing was received or the pool is empty. enc28j60.hpp wraps
+   them in move-only C++ handles. */
+void ENC28J60_framePoolSetup(ENC28J60_FramePool* pool);
+ENC28J60_Frame* ENC28J60_frameAcquire(ENC28J60_FramePool* pool);
+void ENC28J60_frameRelease(ENC28J60_Frame* frame);
+ENC28J60_Frame* ENC28J60_receiveFrame(ENC28J60* enc28j60, ENC28J60_FramePool* pool);
+int ENC28J60_sendFrame(ENC28J60* enc28j60, ENC28J60_Frame* frame);
+HAL_StatusTypeDef ENC28J60_queueFrame(ENC28J60* enc28j60, ENC28J60_TxClass txClass, ENC28J60_Frame* frame);
+
+/* Non-blocking event interface for event loops and schedulers. After
+   ENC28J60_enableInterrupts the INT pin goes low whenever one of the
+   events in the ENC28J60_EVENT_* mask happens, e.g. ENC28J60_EVENTS_ALL;
+   0 disables the pin. ENC28J60_pollEvents then reports and acknowledges
+   what happened, masked or not. */
+void ENC28J60_enableInterrupts(ENC28J60* enc28j60, uint8_t events);
+uint8_t ENC28J60_pollEvents(ENC28J60* enc28j60);
+uint8_t ENC28J60_isLinkUp(ENC28J60* enc28j60);
+uint8_t ENC28J60_isHealthy(ENC28J60* enc28j60);
+
+HAL_StatusTypeDef ENC28J60_setMacAddress(ENC28J60* enc28j60, const uint8_t* macAddress);
+void ENC28J60_flushTx(ENC28J60* enc28j60);
+
+uint16_t ENC28J60_rxBufferUsed(ENC28J60* enc28j60);
+void ENC28J60_setFrameTap(ENC28J60* enc28j60, ENC28J60_FrameTap tap, void* context);
+void ENC28J60_setFrameTapBuffer(ENC28J60* enc28j60, uint8_t* buffer, uint16_t bufsize);
+
+HAL_StatusTypeDef ENC28J60_setMacTiming(ENC28J60* enc28j60, const ENC28J60_MacTiming* timing);
+void ENC28J60_setTxPacing(ENC28J60* enc28j60, uint8_t enable);
+void ENC28J60_setRateLimit(ENC28J60* enc28j60, uint32_t bytesPerSecond, uint32_t burstBytes);
+HAL_StatusTypeDef ENC28J60_addMacAddress(ENC28J60* enc28j60, const uint8_t* macAddress);
+HAL_StatusTypeDef ENC28J60_removeMacAddress(ENC28J60* enc28j60, const uint8_t* macAddress);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,163 @@
+
+#ifndef _enc28j60_hpp_
+#define _enc28j60_hpp_
+
+#include "enc28j60.h"
+#include <cstddef>
+#include <utility>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#  include <span>
+#endif
+
+/* C++ handles for pooled frames. A Frame owns its pool buffer and gives
+   it back when destroyed, it can be moved but not copied, so frames pass
+   from stage to stage without copies or manual releases. The pool must
+   outlive its frames. */
+namespace enc28j60 {
+
+class Frame {
+public:
+  Frame() noexcept : frame_(nullptr) {}
+  explicit Frame(ENC28J60_Frame* frame) noexcept : frame_(frame) {}
+  Frame(const Frame&) = delete;
+  Frame& operator=(const Frame&) = delete;
+  Frame(Frame&& other) noexcept : frame_(other.release()) {}
+
+  Frame& operator=(Frame&& other) noexcept {
+    if (this != &other) {
+      reset(other.release());
+    }
+    return *this;
+  }
+
+  ~Frame() {
+    reset();
+  }
+
+  explicit operator bool() const noexcept {
+    return frame_ != nullptr;
+  }
+
+  ENC28J60_Frame* get() const noexcept {
+    return frame_;
+  }
+
+  /* Hands the buffer on, e.g. to the C functions taking ownership */
+  ENC28J60_Frame* release() noexcept {
+    ENC28J60_Frame* frame = frame_;
+    frame_ = nullptr;
+    return frame;
+  }
+
+  void reset(ENC28J60_Frame* frame = nullptr) noexcept {
+    ENC28J60_frameRelease(frame_);
+    frame_ = frame;
+  }
+
+  uint16_t size() const noexcept {
+    return frame_->length;
+  }
+
+  static constexpr uint16_t capacity() noexcept {
+    return ENC28J60_MAX_FRAME_LENGTH;
+  }
+
+  /* Fails for lengths beyond the buffer */
+  bool resize(uint16_t length) noexcept {
+    if (length > capacity()) {
+      return false;
+    }
+    frame_->length = length;
+    return true;
+  }
+
+  uint8_t* bytes() noexcept {
+    return frame_->data;
+  }
+
+  const uint8_t* bytes() const noexcept {
+    return frame_->data;
+  }
+
+#ifdef __cpp_lib_span
+  /* The frame's contents */
+  std::span<const std::byte> data() const noexcept {
+    return std::as_bytes(std::span<const uint8_t>(frame_->data, frame_->length));
+  }
+
+  /* The whole buffer, to build a frame in before resize */
+  std::span<std::byte> buffer() noexcept {
+    return std::as_writable_bytes(std::span<uint8_t>(frame_->data, capacity()));
+  }
+#endif
+
+private:
+  ENC28J60_Frame* frame_;
+};
+
+/* Frames point back into the pool, so it stays where it was set up */
+class FramePool {
+public:
+  FramePool() noexcept {
+    ENC28J60_framePoolSetup(&pool_);
+  }
+
+  FramePool(const FramePool&) = delete;
+  FramePool& operator=(const FramePool&) = delete;
+
+  /* Empty when the pool is exhausted */
+  Frame acquire() noexcept {
+    return Frame(ENC28J60_frameAcquire(&pool_));
+  }
+
+  uint8_t available() const noexcept {
+    return pool_.available;
+  }
+
+  ENC28J60_FramePool* get() noexcept {
+    return &pool_;
+  }
+
+private:
+  ENC28J60_FramePool pool_;
+};
+
+/* Empty when nothing was received or the pool is exhausted */
+inline Frame receive(ENC28J60* enc28j60, FramePool& pool) noexcept {
+  return Frame(ENC28J60_receiveFrame(enc28j60, pool.get()));
+}
+
+/* send and queue consume the frame whether they succeed or not */
+inline int send(ENC28J60* enc28j60, Frame&& frame) noexcept {
+  if (!frame) {
+    return 0;
+  }
+  return ENC28J60_sendFrame(enc28j60, frame.release());
+}
+
+inline HAL_StatusTypeDef queue(ENC28J60* enc28j60, ENC28J60_TxClass txClass, Frame&& frame) noexcept {
+  if (!frame) {
+    return HAL_ERROR;
+  }
+  return ENC28J60_queueFrame(enc28j60, txClass, frame.release());
+}
+
+#ifdef __cpp_lib_span
+inline int send(ENC28J60* enc28j60, std::span<const std::byte> data) noexcept {
+  if (data.size() > ENC28J60_MAX_TX_LENGTH) {
+    return 0;
+  }
+  return ENC28J60_send(enc28j60, reinterpret_cast<const uint8_t*>(data.data()), static_cast<uint16_t>(data.size()));
+}
+
+/* Returns the length received, 0 if nothing was */
+inline int receive(ENC28J60* enc28j60, std::span<std::byte> buffer) noexcept {
+  uint16_t bufsize = buffer.size() > 0xffff ? 0xffff : static_cast<uint16_t>(buffer.size());
+  return ENC28J60_receive(enc28j60, reinterpret_cast<uint8_t*>(buffer.data()), bufsize);
+}
+#endif
+
+}
+
+#endif
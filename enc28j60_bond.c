@@ -0,0 +1,168 @@
+#include "enc28j60_bond.h"
+#include <string.h>
+
+#define ETHER_HEADER_LENGTH 14
+#define ETHERTYPE_IPV4      0x0800
+#define IPV4_PROTO_TCP      6
+#define IPV4_PROTO_UDP      17
+
+#define FNV_OFFSET_BASIS 0x811c9dc5
+#define FNV_PRIME        0x01000193
+
+uint8_t _ENC28J60_bondSelect(ENC28J60_Bond* bond, const uint8_t* data, uint16_t datalen);
+uint32_t _ENC28J60_bondFlowHash(const uint8_t* data, uint16_t datalen);
+uint32_t _ENC28J60_bondHashBytes(uint32_t hash, const uint8_t* data, uint16_t len);
+
+HAL_StatusTypeDef ENC28J60_bondSetup(ENC28J60_Bond* bond, ENC28J60* const* interfaces, uint8_t count, uint8_t mode, ENC28J60_FramePool* pool) {
+  uint8_t i;
+
+  if (count == 0 || count > ENC28J60_BOND_MAX_INTERFACES) {
+    return HAL_ERROR;
+  }
+
+  memset(bond, 0, sizeof(*bond));
+  bond->count = count;
+  bond->mode = mode;
+  bond->pool = pool;
+  for (i = 0; i < count; i++) {
+    bond->interfaces[i] = interfaces[i];
+    /* Peers learn the bond's address on whichever link they hear it */
+    if (i > 0 && ENC28J60_setMacAddress(interfaces[i], interfaces[0]->macAddress) != HAL_OK) {
+      return HAL_ERROR;
+    }
+  }
+  ENC28J60_bondTick(bond);
+  return HAL_OK;
+}
+
+void ENC28J60_bondTick(ENC28J60_Bond* bond) {
+  uint8_t i;
+
+  bond->linkUp = 0;
+  for (i = 0; i < bond->count; i++) {
+    ENC28J60_tick(bond->interfaces[i]);
+    if (ENC28J60_isLinkUp(bond->interfaces[i])) {
+      bond->linkUp |= 1 << i;
+    }
+  }
+}
+
+HAL_StatusTypeDef ENC28J60_bondQueue(ENC28J60_Bond* bond, ENC28J60_TxClass txClass, const uint8_t* data, uint16_t datalen) {
+  uint8_t i = _ENC28J60_bondSelect(bond, data, datalen);
+
+  bond->txFrames[i]++;
+  return ENC28J60_queue(bond->interfaces[i], txClass, data, datalen);
+}
+
+HAL_StatusTypeDef ENC28J60_bondQueueFrame(ENC28J60_Bond* bond, ENC28J60_TxClass txClass, ENC28J60_Frame* frame) {
+  uint8_t i = _ENC28J60_bondSelect(bond, frame->data, frame->length);
+
+  bond->txFrames[i]++;
+  return ENC28J60_queueFrame(bond->interfaces[i], txClass, frame);
+}
+
+void ENC28J60_bondPoll(ENC28J60_Bond* bond) {
+  ENC28J60_Frame* frame;
+  uint8_t i, received;
+
+  for (i = 0; i < bond->count; i++) {
+    ENC28J60_serviceTx(bond->interfaces[i]);
+  }
+
+  /* One frame per member and round, so a busy link can't hold back the
+     other. Start each call with a different member. */
+  do {
+    received = 0;
+    for (i = 0; i < bond->count && bond->pool->available > 0; i++) {
+      frame = ENC28J60_receiveFrame(bond->interfaces[bond->rxNext], bond->pool);
+      if (frame != NULL) {
+        frame->next = NULL;
+        if (bond->rxTail != NULL) {
+          bond->rxTail->next = frame;
+        } else {
+          bond->rxHead = frame;
+        }
+        bond->rxTail = frame;
+        bond->rxFrames[bond->rxNext]++;
+        received++;
+      }
+      bond->rxNext = (bond->rxNext + 1) % bond->count;
+    }
+  } while (received > 0);
+}
+
+ENC28J60_Frame* ENC28J60_bondReceiveFrame(ENC28J60_Bond* bond) {
+  ENC28J60_Frame* frame;
+
+  if (bond->rxHead == NULL) {
+    ENC28J60_bondPoll(bond);
+  }
+
+  frame = bond->rxHead;
+  if (frame != NULL) {
+    bond->rxHead = frame->next;
+    if (bond->rxHead == NULL) {
+      bond->rxTail = NULL;
+    }
+  }
+  return frame;
+}
+
+/* Picks a member with its link up, or any member if none has */
+uint8_t _ENC28J60_bondSelect(ENC28J60_Bond* bond, const uint8_t* data, uint16_t datalen) {
+  uint8_t i, n;
+
+  if (bond->mode == ENC28J60_BOND_FLOW_HASH) {
+    i = _ENC28J60_bondFlowHash(data, datalen) % bond->count;
+  } else {
+    i = bond->txNext;
+    bond->txNext = (bond->txNext + 1) % bond->count;
+  }
+
+  for (n = 0; n < bond->count; n++) {
+    if (bond->linkUp & (1 << i)) {
+      return i;
+    }
+    i = (i + 1) % bond->count;
+  }
+  return i;
+}
+
+/* FNV-1a over the addresses and ethertype, plus the IPv4 addresses and
+   TCP/UDP ports when there are any. Fragments other than the first carry
+   no ports, so only unfragmented packets hash them to keep a flow on one
+   link. */
+uint32_t _ENC28J60_bondFlowHash(const uint8_t* data, uint16_t datalen) {
+  uint32_t hash = FNV_OFFSET_BASIS;
+  uint16_t headerLength;
+  const uint8_t* ip;
+
+  if (datalen < ETHER_HEADER_LENGTH) {
+    return _ENC28J60_bondHashBytes(hash, data, datalen);
+  }
+  hash = _ENC28J60_bondHashBytes(hash, data, ETHER_HEADER_LENGTH);
+
+  ip = data + ETHER_HEADER_LENGTH;
+  if (((data[12] << 8) | data[13]) != ETHERTYPE_IPV4 || datalen < ETHER_HEADER_LENGTH + 20) {
+    return hash;
+  }
+  /* Source and destination address */
+  hash = _ENC28J60_bondHashBytes(hash, ip + 12, 8);
+
+  headerLength = (ip[0] & 0x0f) * 4;
+  if ((ip[9] == IPV4_PROTO_TCP || ip[9] == IPV4_PROTO_UDP)
+      && (((ip[6] << 8) | ip[7]) & 0x3fff) == 0
+      && datalen >= ETHER_HEADER_LENGTH + headerLength + 4) {
+    hash = _ENC28J60_bondHashBytes(hash, ip + headerLength, 4);
+  }
+  return hash;
+}
+
+uint32_t _ENC28J60_bondHashBytes(uint32_t hash, const uint8_t* data, uint16_t len) {
+  uint16_t i;
+
+  for (i = 0; i < len; i++) {
+    hash = (hash ^ data[i]) * FNV_PRIME;
+  }
+  return hash;
+}
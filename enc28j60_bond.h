@@ -0,0 +1,58 @@
+
+#ifndef _enc28j60_bond_h_
+#define _enc28j60_bond_h_
+
+#include "enc28j60.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef ENC28J60_BOND_MAX_INTERFACES
+#  define ENC28J60_BOND_MAX_INTERFACES 2
+#endif
+
+/* Transmit distribution. Round robin gets the most out of the links but
+   can reorder the frames of a flow; the flow hash keeps every flow on
+   one link. */
+#define ENC28J60_BOND_ROUND_ROBIN 0
+#define ENC28J60_BOND_FLOW_HASH   1
+
+/* Static link aggregation: every member sends with the MAC address of
+   the first one. Received frames of all members are merged into one
+   FIFO of pool frames. linkUp has a bit per member, refreshed by
+   ENC28J60_bondTick. */
+typedef struct {
+  ENC28J60* interfaces[ENC28J60_BOND_MAX_INTERFACES];
+  uint8_t count;
+  uint8_t mode;
+  uint8_t linkUp;
+  uint8_t txNext;
+  uint8_t rxNext;
+  ENC28J60_FramePool* pool;
+  ENC28J60_Frame* rxHead;
+  ENC28J60_Frame* rxTail;
+  uint32_t txFrames[ENC28J60_BOND_MAX_INTERFACES];
+  uint32_t rxFrames[ENC28J60_BOND_MAX_INTERFACES];
+} ENC28J60_Bond;
+
+HAL_StatusTypeDef ENC28J60_bondSetup(ENC28J60_Bond* bond, ENC28J60* const* interfaces, uint8_t count, uint8_t mode, ENC28J60_FramePool* pool);
+void ENC28J60_bondTick(ENC28J60_Bond* bond);
+
+/* Frames are queued on the chosen member and sent by ENC28J60_bondPoll,
+   so all members transmit at the same time */
+HAL_StatusTypeDef ENC28J60_bondQueue(ENC28J60_Bond* bond, ENC28J60_TxClass txClass, const uint8_t* data, uint16_t datalen);
+HAL_StatusTypeDef ENC28J60_bondQueueFrame(ENC28J60_Bond* bond, ENC28J60_TxClass txClass, ENC28J60_Frame* frame);
+
+/* Services the transmit queues and moves received frames into the
+   merged queue, one per member in turn until the members run dry or the
+   pool is empty. ENC28J60_bondReceiveFrame returns the oldest merged
+   frame, which the caller releases, or NULL. */
+void ENC28J60_bondPoll(ENC28J60_Bond* bond);
+ENC28J60_Frame* ENC28J60_bondReceiveFrame(ENC28J60_Bond* bond);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,360 @@
+
+#ifndef _enc28j60_coro_hpp_
+#define _enc28j60_coro_hpp_
+
+#include "enc28j60.hpp"
+#include <coroutine>
+#include <exception>
+
+#ifndef __cpp_impl_coroutine
+#  error "enc28j60_coro.hpp needs C++20 coroutines"
+#endif
+
+/* C++20 coroutines over the non-blocking driver calls:
+
+     enc28j60::Task echo(enc28j60::Interface& eth, enc28j60::FramePool& pool) {
+       co_await eth.linkUp();
+       for (;;) {
+         enc28j60::Frame frame = co_await eth.receive(pool);
+         co_await eth.send(std::move(frame));
+       }
+     }
+
+   A single-threaded Executor resumes the coroutines. Call notify from the
+   INT pin and SPI DMA completion interrupts and run from the main loop;
+   with the INT line not wired, call notify before every run. Nothing
+   here allocates, except the compiler for the coroutine frames. */
+namespace enc28j60 {
+
+class Executor;
+
+/* A coroutine the Executor owns once spawned. It only awaits the
+   Interface operations below, and is destroyed when it returns. */
+class Task {
+public:
+  struct promise_type {
+    Task get_return_object() noexcept {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept {
+      return {};
+    }
+    std::suspend_always final_suspend() noexcept {
+      return {};
+    }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept {
+      std::terminate();
+    }
+  };
+
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+  Task(Task&& other) noexcept : handle_(other.handle_) {
+    other.handle_ = nullptr;
+  }
+
+  ~Task() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+private:
+  friend class Executor;
+
+  explicit Task(std::coroutine_handle<promise_type> handle) noexcept : handle_(handle) {}
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+/* A suspended coroutine and what it waits for. poll retries the
+   operation and returns true once it is done. */
+class Waiter {
+public:
+  Waiter(const Waiter&) = delete;
+  Waiter& operator=(const Waiter&) = delete;
+
+protected:
+  Waiter() noexcept : next_(nullptr) {}
+  ~Waiter() = default;
+
+  virtual bool poll() noexcept = 0;
+
+  std::coroutine_handle<> handle_;
+
+private:
+  friend class Executor;
+
+  Waiter* next_;
+};
+
+class Interface;
+
+class Executor {
+public:
+  Executor() noexcept : waiting_(nullptr), waitingTail_(&waiting_), interfaces_(nullptr), pending_(true) {}
+  Executor(const Executor&) = delete;
+  Executor& operator=(const Executor&) = delete;
+
+  /* Destroys the coroutines still waiting */
+  ~Executor() {
+    Waiter* waiter;
+
+    while ((waiter = waiting_) != nullptr) {
+      waiting_ = waiter->next_;
+      waiter->handle_.destroy();
+    }
+  }
+
+  /* Runs the task up to its first wait */
+  void spawn(Task&& task) noexcept {
+    std::coroutine_handle<> handle = task.handle_;
+
+    task.handle_ = nullptr;
+    resume(handle);
+  }
+
+  /* Safe from interrupts */
+  void notify() noexcept {
+    pending_ = true;
+  }
+
+  /* Nothing happens without a notify since the last run. Otherwise each
+     interface's events are collected and acknowledged, its transmit
+     queues serviced, and every waiting coroutine whose operation now
+     completes is resumed. Returns the number resumed. */
+  unsigned run() noexcept;
+
+  void wait(Waiter* waiter, std::coroutine_handle<> handle) noexcept {
+    waiter->handle_ = handle;
+    waiter->next_ = nullptr;
+    *waitingTail_ = waiter;
+    waitingTail_ = &waiter->next_;
+  }
+
+private:
+  friend class Interface;
+
+  static void resume(std::coroutine_handle<> handle) noexcept {
+    handle.resume();
+    if (handle.done()) {
+      handle.destroy();
+    }
+  }
+
+  Waiter* waiting_;
+  Waiter** waitingTail_;
+  Interface* interfaces_;
+  volatile bool pending_;
+};
+
+/* An interface driven by an Executor. Its chip must have had
+   ENC28J60_enableInterrupts called if the INT line is used. */
+class Interface {
+public:
+  Interface(Executor& executor, ENC28J60* enc28j60) noexcept
+    : executor_(executor), enc28j60_(enc28j60), events_(0), next_(executor.interfaces_) {
+    executor.interfaces_ = this;
+  }
+
+  Interface(const Interface&) = delete;
+  Interface& operator=(const Interface&) = delete;
+
+  ~Interface() {
+    Interface** link = &executor_.interfaces_;
+
+    while (*link != this) {
+      link = &(*link)->next_;
+    }
+    *link = next_;
+  }
+
+  ENC28J60* get() const noexcept {
+    return enc28j60_;
+  }
+
+  /* ENC28J60_EVENT_* seen by the last run */
+  uint8_t events() const noexcept {
+    return events_;
+  }
+
+  /* Resumes with the length of the frame copied into buffer. Frames that
+     don't fit are dropped, as by ENC28J60_receive. */
+  class ReceiveAwaiter : public Waiter {
+  public:
+    ReceiveAwaiter(Interface& interface, std::span<std::byte> buffer) noexcept
+      : interface_(interface), buffer_(buffer), length_(0) {}
+
+    bool await_ready() noexcept {
+      return poll();
+    }
+    void await_suspend(std::coroutine_handle<> handle) noexcept {
+      interface_.executor_.wait(this, handle);
+    }
+    int await_resume() noexcept {
+      return length_;
+    }
+
+  protected:
+    bool poll() noexcept override {
+      length_ = enc28j60::receive(interface_.enc28j60_, buffer_);
+      return length_ > 0;
+    }
+
+  private:
+    Interface& interface_;
+    std::span<std::byte> buffer_;
+    int length_;
+  };
+
+  /* Resumes with a pooled frame. An exhausted pool counts as nothing
+     received, the frame waits in the ring until a buffer comes back. */
+  class FrameAwaiter : public Waiter {
+  public:
+    FrameAwaiter(Interface& interface, FramePool& pool) noexcept : interface_(interface), pool_(pool) {}
+
+    bool await_ready() noexcept {
+      return poll();
+    }
+    void await_suspend(std::coroutine_handle<> handle) noexcept {
+      interface_.executor_.wait(this, handle);
+    }
+    Frame await_resume() noexcept {
+      return std::move(frame_);
+    }
+
+  protected:
+    bool poll() noexcept override {
+      if (pool_.available() == 0) {
+        return false;
+      }
+      frame_ = enc28j60::receive(interface_.enc28j60_, pool_);
+      return static_cast<bool>(frame_);
+    }
+
+  private:
+    Interface& interface_;
+    FramePool& pool_;
+    Frame frame_;
+  };
+
+  /* Waits for room in the transmit queue and resumes with the
+     ENC28J60_queueFrame result. The frame goes out as soon as the chip
+     is free, from here or from a later run. */
+  class SendAwaiter : public Waiter {
+  public:
+    SendAwaiter(Interface& interface, Frame&& frame, ENC28J60_TxClass txClass) noexcept
+      : interface_(interface), frame_(std::move(frame)), txClass_(txClass), status_(HAL_ERROR) {}
+
+    bool await_ready() noexcept {
+      return poll();
+    }
+    void await_suspend(std::coroutine_handle<> handle) noexcept {
+      interface_.executor_.wait(this, handle);
+    }
+    HAL_StatusTypeDef await_resume() noexcept {
+      return status_;
+    }
+
+  protected:
+    bool poll() noexcept override {
+      if (frame_ && ENC28J60_txQueueDepth(interface_.enc28j60_, txClass_) >= ENC28J60_TX_QUEUE_DEPTH) {
+        return false;
+      }
+      status_ = enc28j60::queue(interface_.enc28j60_, txClass_, std::move(frame_));
+      ENC28J60_serviceTx(interface_.enc28j60_);
+      return true;
+    }
+
+  private:
+    Interface& interface_;
+    Frame frame_;
+    ENC28J60_TxClass txClass_;
+    HAL_StatusTypeDef status_;
+  };
+
+  /* The PHY is only asked again after a link change event */
+  class LinkAwaiter : public Waiter {
+  public:
+    explicit LinkAwaiter(Interface& interface) noexcept : interface_(interface) {}
+
+    bool await_ready() noexcept {
+      return ENC28J60_isLinkUp(interface_.enc28j60_);
+    }
+    void await_suspend(std::coroutine_handle<> handle) noexcept {
+      interface_.executor_.wait(this, handle);
+    }
+    void await_resume() noexcept {}
+
+  protected:
+    bool poll() noexcept override {
+      return (interface_.events_ & ENC28J60_EVENT_LINK) != 0 && ENC28J60_isLinkUp(interface_.enc28j60_);
+    }
+
+  private:
+    Interface& interface_;
+  };
+
+  ReceiveAwaiter receive(std::span<std::byte> buffer) noexcept {
+    return ReceiveAwaiter(*this, buffer);
+  }
+
+  FrameAwaiter receive(FramePool& pool) noexcept {
+    return FrameAwaiter(*this, pool);
+  }
+
+  SendAwaiter send(Frame&& frame, ENC28J60_TxClass txClass = ENC28J60_TX_BULK) noexcept {
+    return SendAwaiter(*this, std::move(frame), txClass);
+  }
+
+  LinkAwaiter linkUp() noexcept {
+    return LinkAwaiter(*this);
+  }
+
+private:
+  friend class Executor;
+
+  Executor& executor_;
+  ENC28J60* enc28j60_;
+  uint8_t events_;
+  Interface* next_;
+};
+
+inline unsigned Executor::run() noexcept {
+  Interface* interface;
+  Waiter* waiter;
+  Waiter* next;
+  unsigned resumed;
+
+  if (!pending_) {
+    return 0;
+  }
+  /* Cleared first, an interrupt from here on makes for another pass */
+  pending_ = false;
+
+  for (interface = interfaces_; interface != nullptr; interface = interface->next_) {
+    interface->events_ = ENC28J60_pollEvents(interface->enc28j60_);
+    ENC28J60_serviceTx(interface->enc28j60_);
+  }
+
+  /* Coroutines resumed here may wait again, they go on a fresh list */
+  waiter = waiting_;
+  waiting_ = nullptr;
+  waitingTail_ = &waiting_;
+  resumed = 0;
+  for (; waiter != nullptr; waiter = next) {
+    next = waiter->next_;
+    if (!waiter->poll()) {
+      wait(waiter, waiter->handle_);
+      continue;
+    }
+    resume(waiter->handle_);
+    resumed++;
+  }
+  return resumed;
+}
+
+}
+
+#endif
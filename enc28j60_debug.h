@@ -0,0 +1,12 @@
+
+#ifndef _enc28j60_debug_h_
+#define _enc28j60_debug_h_
+
+/* Internal to the driver and its layers, not for applications */
+#ifdef ENC28J60_DEBUG
+#define ENC28J60_DEBUG_OUT(format, ...) printf("%s:%d: ENC28J60: " format, __FILE__, __LINE__, ##__VA_ARGS__)
+#else
+#define ENC28J60_DEBUG_OUT(format, ...)
+#endif
+
+#endif
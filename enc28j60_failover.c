@@ -0,0 +1,182 @@
+#include "enc28j60_failover.h"
+#include <string.h>
+#include "enc28j60_debug.h"
+
+/* Ethernet header and ARP packet, the chip pads it to the minimum size */
+#define ARP_FRAME_LENGTH 42
+#define ETHERTYPE_ARP    0x0806
+#define ARP_HTYPE_ETHER  0x0001
+#define ARP_PTYPE_IPV4   0x0800
+#define ARP_OPER_REQUEST 0x0001
+
+uint8_t _ENC28J60_failoverIsUsable(ENC28J60* enc28j60);
+void _ENC28J60_failoverTakeAddresses(ENC28J60* from, ENC28J60* to);
+void _ENC28J60_failoverReleaseAddresses(ENC28J60* from, ENC28J60* to, const uint8_t* macAddress);
+HAL_StatusTypeDef _ENC28J60_failoverAnnounce(ENC28J60_Failover* failover);
+
+void ENC28J60_failoverSetup(ENC28J60_Failover* failover, ENC28J60* primary, ENC28J60* standby, const uint8_t* ipAddress) {
+  failover->interfaces[0] = primary;
+  failover->interfaces[1] = standby;
+  failover->active = 0;
+  if (ipAddress != NULL) {
+    memcpy(failover->ipAddress, ipAddress, ENC28J60_IPV4_ADDRESS_LENGTH);
+  } else {
+    memset(failover->ipAddress, 0, ENC28J60_IPV4_ADDRESS_LENGTH);
+  }
+  /* Check on the first poll */
+  failover->lastCheck = ENC28J60_MICROS() - ENC28J60_FAILOVER_CHECK_US;
+  failover->switches = 0;
+  failover->switchTime = 0;
+  failover->standbyUsable = 0;
+}
+
+ENC28J60* ENC28J60_failoverActive(ENC28J60_Failover* failover) {
+  return failover->interfaces[failover->active];
+}
+
+uint8_t ENC28J60_failoverPoll(ENC28J60_Failover* failover) {
+  uint32_t now = ENC28J60_MICROS();
+  uint8_t activeUsable;
+
+  if (now - failover->lastCheck < ENC28J60_FAILOVER_CHECK_US) {
+    return 0;
+  }
+  failover->lastCheck = now;
+
+  activeUsable = _ENC28J60_failoverIsUsable(failover->interfaces[failover->active]);
+  failover->standbyUsable = _ENC28J60_failoverIsUsable(failover->interfaces[failover->active ^ 1]);
+
+  /* Stay put when there is nothing better to go to */
+  if (activeUsable || !failover->standbyUsable) {
+    return 0;
+  }
+  return ENC28J60_failoverSwitch(failover) == HAL_OK;
+}
+
+HAL_StatusTypeDef ENC28J60_failoverSwitch(ENC28J60_Failover* failover) {
+  ENC28J60* from = failover->interfaces[failover->active];
+  ENC28J60* to = failover->interfaces[failover->active ^ 1];
+  uint8_t address[MAC_ADDRESS_LENGTH];
+  HAL_StatusTypeDef status;
+  uint32_t startTime;
+
+  startTime = ENC28J60_MICROS();
+  ENC28J60_DEBUG_OUT("failover to interface %d\n", failover->active ^ 1);
+
+  memcpy(address, to->macAddress, MAC_ADDRESS_LENGTH);
+  _ENC28J60_failoverTakeAddresses(from, to);
+  status = to->spiStatus;
+  if (status != HAL_OK) {
+    /* Stay on the old interface, the next poll tries again. Whatever
+       made it over goes back, the standby must not answer for us. */
+    ENC28J60_DEBUG_OUT("failover err: spi error taking the addresses\n");
+    _ENC28J60_failoverReleaseAddresses(to, from, address);
+    return status;
+  }
+  failover->active ^= 1;
+
+  /* Its watchdog stood still while it was the standby, give it a full
+     period of traffic to judge by */
+  periodicTimer_setup(&to->watchDogTimer, ENC28J60_WATCHDOG_PERIOD);
+  to->receivedPackets = 0;
+  to->sentPackets = 0;
+
+  /* Ethernet switches and ARP caches still point at the old interface,
+     tell them before anything else */
+  status = _ENC28J60_failoverAnnounce(failover);
+  failover->switchTime = ENC28J60_MICROS() - startTime;
+
+  /* Whatever the old interface still holds would go out late or never */
+  ENC28J60_flushTx(from);
+  _ENC28J60_failoverReleaseAddresses(from, to, address);
+
+  failover->switches++;
+  return status;
+}
+
+void ENC28J60_failoverTick(ENC28J60_Failover* failover) {
+  ENC28J60_tick(failover->interfaces[failover->active]);
+  ENC28J60_failoverPoll(failover);
+}
+
+int ENC28J60_failoverSend(ENC28J60_Failover* failover, const uint8_t* data, uint16_t datalen) {
+  return ENC28J60_send(failover->interfaces[failover->active], data, datalen);
+}
+
+int ENC28J60_failoverReceive(ENC28J60_Failover* failover, uint8_t* buffer, uint16_t bufsize) {
+  ENC28J60* standby = failover->interfaces[failover->active ^ 1];
+  int i;
+
+  /* Nothing the standby receives is ours, just keep its ring from
+     overflowing */
+  for (i = 0; i < ENC28J60_FAILOVER_DRAIN_BUDGET && ENC28J60_rxBegin(standby) > 0; i++) {
+    ENC28J60_rxEnd(standby);
+  }
+  return ENC28J60_receive(failover->interfaces[failover->active], buffer, bufsize);
+}
+
+uint8_t _ENC28J60_failoverIsUsable(ENC28J60* enc28j60) {
+  return ENC28J60_isHealthy(enc28j60) && ENC28J60_isLinkUp(enc28j60);
+}
+
+/* Gives the new interface the station address and the extra unicast
+   addresses. The old one keeps answering for them until released. */
+void _ENC28J60_failoverTakeAddresses(ENC28J60* from, ENC28J60* to) {
+  int i;
+
+  ENC28J60_setMacAddress(to, from->macAddress);
+  for (i = 0; i < ENC28J60_EXTRA_MAC_SLOTS; i++) {
+    if (from->extraMacs[i].used) {
+      ENC28J60_addMacAddress(to, from->extraMacs[i].address);
+    }
+  }
+}
+
+/* Hands the old interface macAddress, the new one's former address, so
+   the standby never answers for ours. Removing entries reorders the
+   table, so remove what made it over rather than walk our own. */
+void _ENC28J60_failoverReleaseAddresses(ENC28J60* from, ENC28J60* to, const uint8_t* macAddress) {
+  int i;
+
+  ENC28J60_setMacAddress(from, macAddress);
+  for (i = 0; i < ENC28J60_EXTRA_MAC_SLOTS; i++) {
+    if (to->extraMacs[i].used) {
+      ENC28J60_removeMacAddress(from, to->extraMacs[i].address);
+    }
+  }
+}
+
+/* Gratuitous ARP request for our own address from the new interface */
+HAL_StatusTypeDef _ENC28J60_failoverAnnounce(ENC28J60_Failover* failover) {
+  static const uint8_t noAddress[ENC28J60_IPV4_ADDRESS_LENGTH] = { 0 };
+  ENC28J60* enc28j60 = failover->interfaces[failover->active];
+  uint8_t frame[ARP_FRAME_LENGTH];
+
+  if (memcmp(failover->ipAddress, noAddress, ENC28J60_IPV4_ADDRESS_LENGTH) == 0) {
+    return HAL_OK;
+  }
+
+  memset(frame, 0xff, MAC_ADDRESS_LENGTH);
+  memcpy(frame + 6, enc28j60->macAddress, MAC_ADDRESS_LENGTH);
+  frame[12] = ETHERTYPE_ARP >> 8;
+  frame[13] = ETHERTYPE_ARP & 0xff;
+
+  frame[14] = ARP_HTYPE_ETHER >> 8;
+  frame[15] = ARP_HTYPE_ETHER & 0xff;
+  frame[16] = ARP_PTYPE_IPV4 >> 8;
+  frame[17] = ARP_PTYPE_IPV4 & 0xff;
+  frame[18] = MAC_ADDRESS_LENGTH;
+  frame[19] = ENC28J60_IPV4_ADDRESS_LENGTH;
+  frame[20] = ARP_OPER_REQUEST >> 8;
+  frame[21] = ARP_OPER_REQUEST & 0xff;
+  /* Sender and target protocol address are both ours */
+  memcpy(frame + 22, enc28j60->macAddress, MAC_ADDRESS_LENGTH);
+  memcpy(frame + 28, failover->ipAddress, ENC28J60_IPV4_ADDRESS_LENGTH);
+  memset(frame + 32, 0, MAC_ADDRESS_LENGTH);
+  memcpy(frame + 38, failover->ipAddress, ENC28J60_IPV4_ADDRESS_LENGTH);
+
+  if (ENC28J60_send(enc28j60, frame, sizeof(frame)) != sizeof(frame)) {
+    return HAL_ERROR;
+  }
+  return HAL_OK;
+}
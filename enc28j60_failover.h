@@ -0,0 +1,68 @@
+
+#ifndef _enc28j60_failover_h_
+#define _enc28j60_failover_h_
+
+#include "enc28j60.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Interval in microseconds between link and health checks of the two
+   interfaces. Each check costs a PHY read and a register read per
+   interface. */
+#ifndef ENC28J60_FAILOVER_CHECK_US
+#  define ENC28J60_FAILOVER_CHECK_US 500
+#endif
+
+/* Frames dropped from the standby's ring per ENC28J60_failoverReceive.
+   It must keep up with whatever the standby's segment floods it with. */
+#ifndef ENC28J60_FAILOVER_DRAIN_BUDGET
+#  define ENC28J60_FAILOVER_DRAIN_BUDGET 8
+#endif
+
+#define ENC28J60_IPV4_ADDRESS_LENGTH 4
+
+/* Hot standby over two set up interfaces. The active one carries the
+   station MAC address and the extra unicast addresses; the standby keeps
+   its own MAC address until they are swapped on a switch. switchTime is
+   the microseconds the last switch took until it was announced.
+   standbyUsable is the standby's health and link at the last check. */
+typedef struct {
+  ENC28J60* interfaces[2];
+  uint8_t active;
+  uint8_t ipAddress[ENC28J60_IPV4_ADDRESS_LENGTH];
+  uint32_t lastCheck;
+  uint32_t switches;
+  uint32_t switchTime;
+  uint8_t standbyUsable;
+} ENC28J60_Failover;
+
+/* ipAddress is announced with a gratuitous ARP after a switch, NULL
+   disables the announcement */
+void ENC28J60_failoverSetup(ENC28J60_Failover* failover, ENC28J60* primary, ENC28J60* standby, const uint8_t* ipAddress);
+ENC28J60* ENC28J60_failoverActive(ENC28J60_Failover* failover);
+
+/* Checks both interfaces at most every ENC28J60_FAILOVER_CHECK_US and
+   switches when the active one lost its link or stopped answering while
+   the standby is fine. Returns 1 after a switch. Call it from the main
+   loop, ENC28J60_failoverTick also does. */
+uint8_t ENC28J60_failoverPoll(ENC28J60_Failover* failover);
+
+/* Fails without switching when the standby can't take the addresses,
+   the active interface keeps them and its queued frames */
+HAL_StatusTypeDef ENC28J60_failoverSwitch(ENC28J60_Failover* failover);
+
+/* Runs ENC28J60_tick on the active interface only. The standby carries
+   none of our traffic, so its watchdog would take it for hung and reset
+   it every period; it only gets the checks of failoverPoll. */
+void ENC28J60_failoverTick(ENC28J60_Failover* failover);
+
+int ENC28J60_failoverSend(ENC28J60_Failover* failover, const uint8_t* data, uint16_t datalen);
+int ENC28J60_failoverReceive(ENC28J60_Failover* failover, uint8_t* buffer, uint16_t bufsize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,179 @@
+#include "enc28j60_pollset.h"
+#include <string.h>
+
+#define RX_RING_SIZE (ENC28J60_RX_BUF_END + 1)
+
+/* Credit a port held back by its chip may carry over */
+#define TX_DEFICIT_MAX (ENC28J60_POLLSET_TX_QUANTUM + ENC28J60_MAX_FRAME_LENGTH)
+
+uint8_t _ENC28J60_pollSetIsPending(ENC28J60_PollPort* port);
+uint16_t _ENC28J60_pollSetReceive(ENC28J60_PollSet* set, uint8_t index);
+uint16_t _ENC28J60_pollSetTransmit(ENC28J60_PollPort* port);
+uint32_t _ENC28J60_pollSetSent(ENC28J60* enc28j60);
+
+void ENC28J60_pollSetSetup(ENC28J60_PollSet* set, uint8_t* buffer, uint16_t bufsize, ENC28J60_RxHandler handler, void* context) {
+  memset(set, 0, sizeof(*set));
+  set->buffer = buffer;
+  set->bufsize = bufsize;
+  set->handler = handler;
+  set->context = context;
+}
+
+int ENC28J60_pollSetAdd(ENC28J60_PollSet* set, ENC28J60* enc28j60, GPIO_TypeDef* intPort, uint16_t intPin) {
+  ENC28J60_PollPort* port;
+
+  if (set->count >= ENC28J60_POLLSET_MAX_PORTS) {
+    return -1;
+  }
+  port = &set->ports[set->count];
+  memset(port, 0, sizeof(*port));
+  port->enc28j60 = enc28j60;
+  port->intPort = intPort;
+  port->intPin = intPin;
+  return set->count++;
+}
+
+uint16_t ENC28J60_pollSetRun(ENC28J60_PollSet* set) {
+  ENC28J60_PollPort* port;
+  uint16_t handled;
+  uint8_t i, index;
+
+  handled = 0;
+  for (i = 0; i < set->count; i++) {
+    /* Rotate who goes first, the first port sees the least latency */
+    index = (set->next + i) % set->count;
+    port = &set->ports[index];
+
+    _ENC28J60_pollSetTransmit(port);
+    if (!_ENC28J60_pollSetIsPending(port)) {
+      /* An idle port can't bank credit for a later burst */
+      port->deficit = 0;
+      continue;
+    }
+    handled += _ENC28J60_pollSetReceive(set, index);
+  }
+  if (set->count > 0) {
+    set->next = (set->next + 1) % set->count;
+  }
+  return handled;
+}
+
+uint8_t ENC28J60_pollSetEvents(ENC28J60_PollSet* set, uint8_t port) {
+  uint8_t events = set->ports[port].events;
+
+  set->ports[port].events = 0;
+  return events;
+}
+
+/* The INT line stays low until the flags behind it are acknowledged,
+   pollEvents does that for all but pending packets */
+uint8_t _ENC28J60_pollSetIsPending(ENC28J60_PollPort* port) {
+  uint8_t events;
+
+  if (port->intPort == NULL) {
+    return 1;
+  }
+  if (HAL_GPIO_ReadPin(port->intPort, port->intPin) != GPIO_PIN_RESET) {
+    return 0;
+  }
+  events = ENC28J60_pollEvents(port->enc28j60);
+  port->events |= events;
+  return (events & ENC28J60_EVENT_RX) != 0;
+}
+
+uint16_t _ENC28J60_pollSetReceive(ENC28J60_PollSet* set, uint8_t index) {
+  ENC28J60_PollPort* port = &set->ports[index];
+  ENC28J60* enc28j60 = port->enc28j60;
+  uint16_t handled, used;
+  int len;
+
+  /* EPKTCNT is one register read, only look at the ring when a frame
+     is there */
+  len = ENC28J60_rxBegin(enc28j60);
+  if (len == 0) {
+    port->deficit = 0;
+    return 0;
+  }
+
+  /* A ring close to overflowing gets a larger share */
+  used = ENC28J60_rxBufferUsed(enc28j60);
+  port->deficit += ENC28J60_POLLSET_QUANTUM + ((uint32_t) ENC28J60_POLLSET_QUANTUM * used) / RX_RING_SIZE;
+
+  handled = 0;
+  do {
+    /* The frame stays open and is the first one next round */
+    if ((uint32_t) len > port->deficit) {
+      return handled;
+    }
+    port->deficit -= len;
+
+    if (len > set->bufsize || ENC28J60_rxRead(enc28j60, set->buffer, len) != len) {
+      ENC28J60_rxEnd(enc28j60);
+      port->rxDropped++;
+    } else {
+      ENC28J60_rxEnd(enc28j60);
+      port->rxFrames++;
+      port->rxBytes += len;
+      handled++;
+      set->handler(set->context, index, set->buffer, len);
+    }
+    len = ENC28J60_rxBegin(enc28j60);
+  } while (len > 0);
+
+  port->deficit = 0;
+  return handled;
+}
+
+/* Returns the number of frames sent */
+uint16_t _ENC28J60_pollSetTransmit(ENC28J60_PollPort* port) {
+  ENC28J60* enc28j60 = port->enc28j60;
+  uint16_t handled, len;
+  uint32_t sent;
+
+  len = ENC28J60_txNextLength(enc28j60);
+  if (len == 0) {
+    /* Still collects the frame in flight and launches a scheduled one */
+    port->txDeficit = 0;
+    ENC28J60_serviceTx(enc28j60);
+    return 0;
+  }
+
+  port->txDeficit += ENC28J60_POLLSET_TX_QUANTUM;
+  if (port->txDeficit > TX_DEFICIT_MAX) {
+    port->txDeficit = TX_DEFICIT_MAX;
+  }
+
+  handled = 0;
+  do {
+    /* The frame stays queued and is the first one next round */
+    if (len > port->txDeficit) {
+      ENC28J60_pollScheduled(enc28j60);
+      return handled;
+    }
+
+    sent = _ENC28J60_pollSetSent(enc28j60);
+    ENC28J60_serviceTx(enc28j60);
+    if (_ENC28J60_pollSetSent(enc28j60) == sent) {
+      /* The chip is busy or the shaper holds the frame back */
+      return handled;
+    }
+    port->txDeficit -= len;
+    port->txFrames++;
+    port->txBytes += len;
+    handled++;
+    len = ENC28J60_txNextLength(enc28j60);
+  } while (len > 0);
+
+  port->txDeficit = 0;
+  return handled;
+}
+
+uint32_t _ENC28J60_pollSetSent(ENC28J60* enc28j60) {
+  uint32_t sent = 0;
+  int i;
+
+  for (i = 0; i < ENC28J60_TX_CLASSES; i++) {
+    sent += enc28j60->txQueues[i].sent;
+  }
+  return sent;
+}
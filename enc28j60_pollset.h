@@ -0,0 +1,79 @@
+
+#ifndef _enc28j60_pollset_h_
+#define _enc28j60_pollset_h_
+
+#include "enc28j60.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef ENC28J60_POLLSET_MAX_PORTS
+#  define ENC28J60_POLLSET_MAX_PORTS 8
+#endif
+
+/* Bytes a port may receive per round, at least one full frame. A port
+   whose ring is filling up gets up to twice as much. */
+#ifndef ENC28J60_POLLSET_QUANTUM
+#  define ENC28J60_POLLSET_QUANTUM ENC28J60_MAX_FRAME_LENGTH
+#endif
+
+/* Bytes a port may send per round. Below a full frame, a port with long
+   frames queued sends one only every few rounds. */
+#ifndef ENC28J60_POLLSET_TX_QUANTUM
+#  define ENC28J60_POLLSET_TX_QUANTUM ENC28J60_MAX_FRAME_LENGTH
+#endif
+
+/* Gets every frame the poll set receives, data is only valid during the
+   call */
+typedef void (*ENC28J60_RxHandler)(void* context, uint8_t port, const uint8_t* data, uint16_t length);
+
+/* intPort is NULL when the INT line of the chip is not wired, the chip
+   is then asked for pending packets every round. events collects what
+   ENC28J60_pollEvents reported for a port with an INT line. */
+typedef struct {
+  ENC28J60* enc28j60;
+  GPIO_TypeDef* intPort;
+  uint16_t intPin;
+  uint32_t deficit;
+  uint32_t txDeficit;
+  uint8_t events;
+  uint32_t rxFrames;
+  uint32_t rxBytes;
+  uint32_t rxDropped;
+  uint32_t txFrames;
+  uint32_t txBytes;
+} ENC28J60_PollPort;
+
+typedef struct {
+  ENC28J60_PollPort ports[ENC28J60_POLLSET_MAX_PORTS];
+  uint8_t count;
+  uint8_t next;
+  uint8_t* buffer;
+  uint16_t bufsize;
+  ENC28J60_RxHandler handler;
+  void* context;
+} ENC28J60_PollSet;
+
+void ENC28J60_pollSetSetup(ENC28J60_PollSet* set, uint8_t* buffer, uint16_t bufsize, ENC28J60_RxHandler handler, void* context);
+
+/* Ports with an INT line must have had ENC28J60_enableInterrupts called
+   with at least ENC28J60_EVENT_RX. Returns the port number, or -1 when
+   the set is full. */
+int ENC28J60_pollSetAdd(ENC28J60_PollSet* set, ENC28J60* enc28j60, GPIO_TypeDef* intPort, uint16_t intPin);
+
+/* One round over all ports: each port sends queued frames up to its
+   transmit deficit, then receives up to its receive deficit. Both are
+   deficit round robin, so ports share the SPI bus by bytes moved rather
+   than frames. A frame the chip or the shaper holds back keeps the
+   credit for it, a scheduled frame is launched regardless. The set owns
+   the receive side of its chips, frames are not passed to the frame
+   tap. Returns the number of frames received. */
+uint16_t ENC28J60_pollSetRun(ENC28J60_PollSet* set);
+uint8_t ENC28J60_pollSetEvents(ENC28J60_PollSet* set, uint8_t port);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,287 @@
+#include "enc28j60_reasm.h"
+#include <string.h>
+#include "enc28j60_debug.h"
+
+#if ENC28J60_REASM_SLOT_SIZE == 0
+
+/* No chip memory set aside, as by default: nothing is reassembled, every
+   frame is left to the caller and no datagram is ever ready */
+void ENC28J60_reasmSetup(ENC28J60_Reasm* reasm, ENC28J60* enc28j60) {
+  memset(reasm, 0, sizeof(*reasm));
+  reasm->enc28j60 = enc28j60;
+}
+
+int ENC28J60_reasmInput(ENC28J60_Reasm* reasm, int len) {
+  (void) reasm;
+  (void) len;
+  return ENC28J60_REASM_NOT_FRAGMENT;
+}
+
+const ENC28J60_ReasmDatagram* ENC28J60_reasmReady(ENC28J60_Reasm* reasm) {
+  (void) reasm;
+  return NULL;
+}
+
+uint16_t ENC28J60_reasmRead(ENC28J60_Reasm* reasm, uint8_t* chunk, uint16_t n) {
+  (void) reasm;
+  (void) chunk;
+  (void) n;
+  return 0;
+}
+
+void ENC28J60_reasmDone(ENC28J60_Reasm* reasm) {
+  (void) reasm;
+}
+
+void ENC28J60_reasmTick(ENC28J60_Reasm* reasm) {
+  (void) reasm;
+}
+
+#else
+
+#define ETHER_HEADER_LENGTH 14
+#define ETHERTYPE_IPV4      0x0800
+#define IPV4_HEADER_MIN     20
+#define IPV4_MORE_FRAGMENTS 0x2000
+#define IPV4_OFFSET_MASK    0x1fff
+
+/* Stands for the unknown end of the datagram until the last fragment */
+#define HOLE_END_UNKNOWN 0xffff
+
+ENC28J60_ReasmDatagram* _ENC28J60_reasmFind(ENC28J60_Reasm* reasm, const uint8_t* ip);
+ENC28J60_ReasmDatagram* _ENC28J60_reasmAllocate(ENC28J60_Reasm* reasm, const uint8_t* ip);
+uint8_t _ENC28J60_reasmFillHoles(ENC28J60_ReasmDatagram* datagram, uint16_t first, uint16_t last, uint8_t more);
+int _ENC28J60_reasmDrop(ENC28J60_Reasm* reasm, ENC28J60_ReasmDatagram* datagram);
+
+void ENC28J60_reasmSetup(ENC28J60_Reasm* reasm, ENC28J60* enc28j60) {
+  int i;
+
+  memset(reasm, 0, sizeof(*reasm));
+  reasm->enc28j60 = enc28j60;
+  for (i = 0; i < ENC28J60_REASM_DATAGRAMS; i++) {
+    reasm->datagrams[i].base = ENC28J60_RESERVED_START + i * ENC28J60_REASM_SLOT_SIZE;
+  }
+}
+
+int ENC28J60_reasmInput(ENC28J60_Reasm* reasm, int len) {
+  uint8_t header[ETHER_HEADER_LENGTH + IPV4_HEADER_MIN];
+  ENC28J60_ReasmDatagram* datagram;
+  const uint8_t* ip = header + ETHER_HEADER_LENGTH;
+  uint16_t fragment, headerLength, totalLength;
+  uint32_t first, last;
+  uint8_t more;
+
+  ENC28J60_reasmTick(reasm);
+
+  if (len < (int) sizeof(header) || ENC28J60_rxPeek(reasm->enc28j60, 0, header, sizeof(header)) != HAL_OK) {
+    return ENC28J60_REASM_NOT_FRAGMENT;
+  }
+  if (((header[12] << 8) | header[13]) != ETHERTYPE_IPV4 || (ip[0] >> 4) != 4) {
+    return ENC28J60_REASM_NOT_FRAGMENT;
+  }
+  fragment = (ip[6] << 8) | ip[7];
+  if ((fragment & (IPV4_MORE_FRAGMENTS | IPV4_OFFSET_MASK)) == 0) {
+    return ENC28J60_REASM_NOT_FRAGMENT;
+  }
+  reasm->fragments++;
+
+  headerLength = (ip[0] & 0x0f) * 4;
+  totalLength = (ip[2] << 8) | ip[3];
+  if (headerLength < IPV4_HEADER_MIN || totalLength <= headerLength || ETHER_HEADER_LENGTH + totalLength > len) {
+    ENC28J60_DEBUG_OUT("reasm: malformed fragment\n");
+    return _ENC28J60_reasmDrop(reasm, NULL);
+  }
+  more = (fragment & IPV4_MORE_FRAGMENTS) != 0;
+  first = (uint32_t) (fragment & IPV4_OFFSET_MASK) * 8;
+  last = first + (totalLength - headerLength) - 1;
+
+  datagram = _ENC28J60_reasmFind(reasm, ip);
+  if (datagram == NULL) {
+    datagram = _ENC28J60_reasmAllocate(reasm, ip);
+    if (datagram == NULL) {
+      ENC28J60_DEBUG_OUT("reasm: no free datagram\n");
+      return _ENC28J60_reasmDrop(reasm, NULL);
+    }
+  }
+  if (last + 1 > ENC28J60_REASM_SLOT_SIZE) {
+    ENC28J60_DEBUG_OUT("reasm: datagram too large\n");
+    return _ENC28J60_reasmDrop(reasm, datagram);
+  }
+
+  /* The payload goes straight from the receive ring to its place */
+  if (ENC28J60_rxCopy(reasm->enc28j60, ETHER_HEADER_LENGTH + headerLength, last - first + 1, datagram->base + first) != HAL_OK) {
+    return _ENC28J60_reasmDrop(reasm, datagram);
+  }
+  if (!_ENC28J60_reasmFillHoles(datagram, first, last, more)) {
+    ENC28J60_DEBUG_OUT("reasm: too many holes\n");
+    return _ENC28J60_reasmDrop(reasm, datagram);
+  }
+  if (!more) {
+    datagram->length = last + 1;
+  }
+  ENC28J60_rxEnd(reasm->enc28j60);
+
+  if (datagram->holeCount > 0) {
+    return ENC28J60_REASM_CONSUMED;
+  }
+  datagram->complete = 1;
+  reasm->completed++;
+  return ENC28J60_REASM_COMPLETE;
+}
+
+const ENC28J60_ReasmDatagram* ENC28J60_reasmReady(ENC28J60_Reasm* reasm) {
+  int i;
+
+  if (reasm->ready != NULL) {
+    return reasm->ready;
+  }
+  for (i = 0; i < ENC28J60_REASM_DATAGRAMS; i++) {
+    if (reasm->datagrams[i].used && reasm->datagrams[i].complete) {
+      reasm->ready = &reasm->datagrams[i];
+      reasm->readOffset = 0;
+      break;
+    }
+  }
+  return reasm->ready;
+}
+
+uint16_t ENC28J60_reasmRead(ENC28J60_Reasm* reasm, uint8_t* chunk, uint16_t n) {
+  const ENC28J60_ReasmDatagram* datagram;
+  uint16_t remaining;
+
+  datagram = ENC28J60_reasmReady(reasm);
+  if (datagram == NULL) {
+    return 0;
+  }
+
+  remaining = datagram->length - reasm->readOffset;
+  if (n > remaining) {
+    n = remaining;
+  }
+  if (n == 0) {
+    return 0;
+  }
+  if (ENC28J60_readMemory(reasm->enc28j60, datagram->base + reasm->readOffset, chunk, n) != HAL_OK) {
+    return 0;
+  }
+  reasm->readOffset += n;
+  return n;
+}
+
+void ENC28J60_reasmDone(ENC28J60_Reasm* reasm) {
+  if (reasm->ready != NULL) {
+    reasm->ready->used = 0;
+    reasm->ready = NULL;
+  }
+}
+
+void ENC28J60_reasmTick(ENC28J60_Reasm* reasm) {
+  ENC28J60_ReasmDatagram* datagram;
+  int i;
+
+  for (i = 0; i < ENC28J60_REASM_DATAGRAMS; i++) {
+    datagram = &reasm->datagrams[i];
+    if (datagram->used && !datagram->complete
+        && ENC28J60_MICROS() - datagram->startTime > ENC28J60_REASM_TIMEOUT_US) {
+      ENC28J60_DEBUG_OUT("reasm: datagram %04x timed out\n", datagram->id);
+      datagram->used = 0;
+      reasm->timeouts++;
+    }
+  }
+}
+
+/* Fragments belong together when source, destination, protocol and
+   identification match (RFC 791) */
+ENC28J60_ReasmDatagram* _ENC28J60_reasmFind(ENC28J60_Reasm* reasm, const uint8_t* ip) {
+  ENC28J60_ReasmDatagram* datagram;
+  int i;
+
+  for (i = 0; i < ENC28J60_REASM_DATAGRAMS; i++) {
+    datagram = &reasm->datagrams[i];
+    if (datagram->used && !datagram->complete
+        && datagram->id == ((ip[4] << 8) | ip[5])
+        && datagram->protocol == ip[9]
+        && memcmp(datagram->source, ip + 12, 4) == 0
+        && memcmp(datagram->destination, ip + 16, 4) == 0) {
+      return datagram;
+    }
+  }
+  return NULL;
+}
+
+ENC28J60_ReasmDatagram* _ENC28J60_reasmAllocate(ENC28J60_Reasm* reasm, const uint8_t* ip) {
+  ENC28J60_ReasmDatagram* datagram;
+  int i;
+
+  for (i = 0; i < ENC28J60_REASM_DATAGRAMS; i++) {
+    datagram = &reasm->datagrams[i];
+    if (datagram->used) {
+      continue;
+    }
+    datagram->used = 1;
+    datagram->complete = 0;
+    datagram->id = (ip[4] << 8) | ip[5];
+    datagram->protocol = ip[9];
+    memcpy(datagram->source, ip + 12, 4);
+    memcpy(datagram->destination, ip + 16, 4);
+    datagram->length = 0;
+    datagram->startTime = ENC28J60_MICROS();
+    datagram->holes[0].first = 0;
+    datagram->holes[0].last = HOLE_END_UNKNOWN;
+    datagram->holeCount = 1;
+    return datagram;
+  }
+  return NULL;
+}
+
+/* RFC 815: every hole the fragment touches is replaced by what is left
+   of it on either side. Nothing is left after the last fragment. */
+uint8_t _ENC28J60_reasmFillHoles(ENC28J60_ReasmDatagram* datagram, uint16_t first, uint16_t last, uint8_t more) {
+  ENC28J60_ReasmHole holes[ENC28J60_REASM_HOLES];
+  ENC28J60_ReasmHole* hole;
+  uint8_t count, i;
+
+  count = 0;
+  for (i = 0; i < datagram->holeCount; i++) {
+    hole = &datagram->holes[i];
+    if (first > hole->last || last < hole->first) {
+      if (count >= ENC28J60_REASM_HOLES) {
+        return 0;
+      }
+      holes[count++] = *hole;
+      continue;
+    }
+    if (first > hole->first) {
+      if (count >= ENC28J60_REASM_HOLES) {
+        return 0;
+      }
+      holes[count].first = hole->first;
+      holes[count].last = first - 1;
+      count++;
+    }
+    if (last < hole->last && more) {
+      if (count >= ENC28J60_REASM_HOLES) {
+        return 0;
+      }
+      holes[count].first = last + 1;
+      holes[count].last = hole->last;
+      count++;
+    }
+  }
+
+  memcpy(datagram->holes, holes, count * sizeof(ENC28J60_ReasmHole));
+  datagram->holeCount = count;
+  return 1;
+}
+
+/* Ends the fragment's frame and gives up on its datagram, if any */
+int _ENC28J60_reasmDrop(ENC28J60_Reasm* reasm, ENC28J60_ReasmDatagram* datagram) {
+  if (datagram != NULL) {
+    datagram->used = 0;
+  }
+  reasm->dropped++;
+  ENC28J60_rxEnd(reasm->enc28j60);
+  return ENC28J60_REASM_CONSUMED;
+}
+
+#endif
@@ -0,0 +1,103 @@
+
+#ifndef _enc28j60_reasm_h_
+#define _enc28j60_reasm_h_
+
+#include "enc28j60.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Datagrams reassembled at once. Each gets an equal, even share of the
+   ENC28J60_RESERVED_SIZE bytes of chip memory, which bounds the largest
+   datagram payload. That region is empty by default, and the layer then
+   passes every frame through: take its size from the receive ring by
+   lowering ENC28J60_RX_BUF_END, or from the retained frame store by
+   lowering ENC28J60_TX_STORE_SIZE. E.g. a 3 KB region fits with a 1.5 KB
+   ring and a 512 byte store. */
+#ifndef ENC28J60_REASM_DATAGRAMS
+#  define ENC28J60_REASM_DATAGRAMS 2
+#endif
+
+/* Hole descriptors per datagram. Fragments arriving in order never use
+   more than one. */
+#ifndef ENC28J60_REASM_HOLES
+#  define ENC28J60_REASM_HOLES 6
+#endif
+
+/* A datagram still missing fragments after this many microseconds is
+   dropped */
+#ifndef ENC28J60_REASM_TIMEOUT_US
+#  define ENC28J60_REASM_TIMEOUT_US (5 * 1000 * 1000)
+#endif
+
+/* The largest payload a datagram can have. Only datagrams that did not
+   fit one frame need reassembling, which behind a 1500 byte MTU means
+   more than 1480 payload bytes. The two 1536 byte slots of the 3 KB
+   example hold little more than that: enough for fragments from smaller
+   MTUs, not for the usual fragmented UDP datagram of several KB. With
+   ENC28J60_REASM_DATAGRAMS at 1, its single slot takes 3 KB. */
+#define ENC28J60_REASM_SLOT_SIZE ((ENC28J60_RESERVED_SIZE / ENC28J60_REASM_DATAGRAMS) & ~1)
+
+/* ENC28J60_reasmInput results */
+#define ENC28J60_REASM_NOT_FRAGMENT 0
+#define ENC28J60_REASM_CONSUMED     1
+#define ENC28J60_REASM_COMPLETE     2
+
+/* Missing payload bytes first to last, inclusive */
+typedef struct {
+  uint16_t first;
+  uint16_t last;
+} ENC28J60_ReasmHole;
+
+/* A datagram being put together in chip memory at base. length is the
+   payload length, known once the last fragment arrived. */
+typedef struct {
+  uint8_t used;
+  uint8_t complete;
+  uint8_t source[4];
+  uint8_t destination[4];
+  uint8_t protocol;
+  uint16_t id;
+  uint16_t base;
+  uint16_t length;
+  uint32_t startTime;
+  uint8_t holeCount;
+  ENC28J60_ReasmHole holes[ENC28J60_REASM_HOLES];
+} ENC28J60_ReasmDatagram;
+
+/* dropped counts fragments that could not be kept: no free datagram,
+   too large for a slot, too many holes or an SPI error. */
+typedef struct {
+  ENC28J60* enc28j60;
+  ENC28J60_ReasmDatagram datagrams[ENC28J60_REASM_DATAGRAMS];
+  ENC28J60_ReasmDatagram* ready;
+  uint16_t readOffset;
+  uint32_t fragments;
+  uint32_t completed;
+  uint32_t timeouts;
+  uint32_t dropped;
+} ENC28J60_Reasm;
+
+void ENC28J60_reasmSetup(ENC28J60_Reasm* reasm, ENC28J60* enc28j60);
+
+/* Call with every frame opened by ENC28J60_rxBegin and its length. A
+   fragment is copied into chip memory and its frame ended. Anything else
+   is left open, unread, for the caller. */
+int ENC28J60_reasmInput(ENC28J60_Reasm* reasm, int len);
+
+/* The next complete datagram, or NULL. Its payload, without the IP
+   header, is streamed with ENC28J60_reasmRead until it returns 0, then
+   ENC28J60_reasmDone frees the datagram. */
+const ENC28J60_ReasmDatagram* ENC28J60_reasmReady(ENC28J60_Reasm* reasm);
+uint16_t ENC28J60_reasmRead(ENC28J60_Reasm* reasm, uint8_t* chunk, uint16_t n);
+void ENC28J60_reasmDone(ENC28J60_Reasm* reasm);
+
+/* Drops datagrams past ENC28J60_REASM_TIMEOUT_US, also done on input */
+void ENC28J60_reasmTick(ENC28J60_Reasm* reasm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
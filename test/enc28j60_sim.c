@@ -0,0 +1,523 @@
+#include "enc28j60_sim.h"
+#include <string.h>
+#include <utils/time.h>
+#include <utils/timer.h>
+
+/* Register addresses and bits as in the data sheet */
+#define EIE   0x1b
+#define EIR   0x1c
+#define ESTAT 0x1d
+#define ECON2 0x1e
+#define ECON1 0x1f
+
+#define EIR_PKTIF  0x40
+#define EIR_DMAIF  0x20
+#define EIR_LINKIF 0x10
+#define EIR_TXIF   0x08
+#define EIR_RXERIF 0x01
+#define EIE_INTIE  0x80
+
+#define ESTAT_CLKRDY 0x01
+#define ECON1_RXRST  0x40
+#define ECON1_DMAST  0x20
+#define ECON1_TXRTS  0x08
+#define ECON1_RXEN   0x04
+#define ECON2_AUTOINC 0x80
+#define ECON2_PKTDEC  0x40
+
+#define ERDPTL   0x00
+#define EWRPTL   0x02
+#define ETXSTL   0x04
+#define ETXNDL   0x06
+#define ERXSTL   0x08
+#define ERXSTH   0x09
+#define ERXNDL   0x0a
+#define ERXRDPTL 0x0c
+#define ERXWRPTL 0x0e
+#define EDMASTL  0x10
+#define EDMANDL  0x12
+#define EDMADSTL 0x14
+
+#define EPKTCNT 0x19
+
+#define MICMD    0x12
+#define MIREGADR 0x14
+#define MIWRL    0x16
+#define MIWRH    0x17
+#define MIRDL    0x18
+#define MIRDH    0x19
+#define MICMD_MIIRD 0x01
+
+#define MISTAT 0x0a
+#define EREVID 0x12
+
+#define PHSTAT2 0x11
+#define PHIR    0x13
+#define PHSTAT2_LSTAT 0x0400
+
+#define RX_HEADER_LENGTH 6
+#define CRC_LENGTH 4
+#define TSV_LENGTH 7
+
+static uint32_t simTime;
+static uint32_t simTicks;
+
+uint8_t* _ENC28J60_simReg(ENC28J60_Sim* sim, uint8_t reg);
+uint16_t _ENC28J60_simReg16(ENC28J60_Sim* sim, uint8_t bank, uint8_t reg);
+void _ENC28J60_simSetReg16(ENC28J60_Sim* sim, uint8_t bank, uint8_t reg, uint16_t value);
+uint8_t _ENC28J60_simIsMacMiiReg(ENC28J60_Sim* sim, uint8_t reg);
+uint8_t _ENC28J60_simReadReg(ENC28J60_Sim* sim, uint8_t reg);
+void _ENC28J60_simWriteReg(ENC28J60_Sim* sim, uint8_t reg, uint8_t value);
+uint8_t _ENC28J60_simExchange(ENC28J60_Sim* sim, uint8_t in);
+void _ENC28J60_simReset(ENC28J60_Sim* sim);
+void _ENC28J60_simTransmit(ENC28J60_Sim* sim);
+void _ENC28J60_simDmaCopy(ENC28J60_Sim* sim);
+uint16_t _ENC28J60_simRingNext(ENC28J60_Sim* sim, uint16_t address);
+
+void ENC28J60_simSetup(ENC28J60_Sim* sim) {
+  memset(sim, 0, sizeof(*sim));
+  sim->spi.sim = sim;
+  sim->csPort.sim = sim;
+  sim->resetPort.sim = sim;
+  sim->intPort.sim = sim;
+  _ENC28J60_simReset(sim);
+}
+
+void ENC28J60_simAttach(ENC28J60_Sim* sim, ENC28J60* enc28j60) {
+  enc28j60->spi = &sim->spi;
+  enc28j60->csPort = &sim->csPort;
+  enc28j60->csPin = 1;
+  enc28j60->resetPort = &sim->resetPort;
+  enc28j60->resetPin = 2;
+}
+
+int ENC28J60_simReceive(ENC28J60_Sim* sim, const uint8_t* data, uint16_t len) {
+  uint16_t start, end, write, read, used, size, count, next, i;
+  uint8_t header[RX_HEADER_LENGTH];
+
+  if ((sim->common[ECON1 - EIE] & ECON1_RXEN) == 0) {
+    return 0;
+  }
+
+  start = _ENC28J60_simReg16(sim, 0, ERXSTL);
+  end = _ENC28J60_simReg16(sim, 0, ERXNDL);
+  write = _ENC28J60_simReg16(sim, 0, ERXWRPTL);
+  read = _ENC28J60_simReg16(sim, 0, ERXRDPTL);
+  size = end - start + 1;
+  used = (write + size - read) % size;
+  count = len + CRC_LENGTH;
+  /* The chip keeps the next header word aligned */
+  if (sim->pendingPackets == 0xff || used + ((RX_HEADER_LENGTH + count + 1) & ~1) >= size) {
+    sim->common[EIR - EIE] |= EIR_RXERIF;
+    return 0;
+  }
+
+  next = write;
+  for (i = 0; i < ((RX_HEADER_LENGTH + count + 1) & ~1); i++) {
+    next = _ENC28J60_simRingNext(sim, next);
+  }
+  header[0] = next & 0xff;
+  header[1] = next >> 8;
+  header[2] = count & 0xff;
+  header[3] = count >> 8;
+  /* Received OK, multicast, broadcast, and control and pause frame for
+     the MAC control type with the pause opcode */
+  header[4] = 0x80;
+  header[5] = 0;
+  if (len >= 6 && (data[0] & 0x01)) {
+    header[5] |= 0x01;
+    if (memcmp(data, "\xff\xff\xff\xff\xff\xff", 6) == 0) {
+      header[5] |= 0x02;
+    }
+  }
+  if (len >= 16 && data[12] == 0x88 && data[13] == 0x08) {
+    header[5] |= 0x08;
+    if (data[14] == 0x00 && data[15] == 0x01) {
+      header[5] |= 0x10;
+    }
+  }
+
+  for (i = 0; i < RX_HEADER_LENGTH + count; i++) {
+    if (i < RX_HEADER_LENGTH) {
+      sim->memory[write] = header[i];
+    } else if (i < RX_HEADER_LENGTH + len) {
+      sim->memory[write] = data[i - RX_HEADER_LENGTH];
+    } else {
+      sim->memory[write] = 0;
+    }
+    write = _ENC28J60_simRingNext(sim, write);
+  }
+  _ENC28J60_simSetReg16(sim, 0, ERXWRPTL, next);
+  sim->pendingPackets++;
+  return 1;
+}
+
+void ENC28J60_simSetLink(ENC28J60_Sim* sim, uint8_t up) {
+  if (up) {
+    sim->phy[PHSTAT2] |= PHSTAT2_LSTAT;
+  } else {
+    sim->phy[PHSTAT2] &= ~PHSTAT2_LSTAT;
+  }
+  sim->common[EIR - EIE] |= EIR_LINKIF;
+}
+
+void ENC28J60_simHoldTx(ENC28J60_Sim* sim) {
+  sim->txHeld = 1;
+}
+
+/* Sends the frame held back, if any */
+void ENC28J60_simReleaseTx(ENC28J60_Sim* sim) {
+  sim->txHeld = 0;
+  if (sim->common[ECON1 - EIE] & ECON1_TXRTS) {
+    _ENC28J60_simTransmit(sim);
+  }
+}
+
+void ENC28J60_simClearLog(ENC28J60_Sim* sim) {
+  sim->transactions = 0;
+  sim->bytes = 0;
+  sim->dmaTransfers = 0;
+  sim->dmaBytes = 0;
+  memset(sim->commands, 0, sizeof(sim->commands));
+}
+
+void ENC28J60_simAdvance(uint32_t ms) {
+  simTime += ms;
+}
+
+/* The clock also creeps forward on its own, so a loop waiting for a
+   deadline the simulation never satisfies still ends */
+uint32_t HAL_GetTick(void) {
+  if (++simTicks % 1024 == 0) {
+    simTime++;
+  }
+  return simTime;
+}
+
+void sleep_ms(uint32_t ms) {
+  simTime += ms;
+}
+
+void sleep_us(uint32_t us) {
+  simTime += (us + 999) / 1000;
+}
+
+void periodicTimer_setup(PeriodicTimer* timer, uint32_t period) {
+  timer->period = period;
+  timer->last = simTime;
+}
+
+int periodicTimer_hasElapsed(PeriodicTimer* timer) {
+  if (simTime - timer->last < timer->period) {
+    return 0;
+  }
+  timer->last = simTime;
+  return 1;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef* port, uint16_t pin, GPIO_PinState state) {
+  ENC28J60_Sim* sim = port->sim;
+
+  if (port == &sim->csPort) {
+    if (state == GPIO_PIN_RESET && !sim->selected) {
+      if (sim->transactions < ENC28J60_SIM_LOG_SIZE) {
+        sim->commands[sim->transactions] = 0;
+      }
+      sim->transactions++;
+      sim->position = 0;
+    }
+    sim->selected = state == GPIO_PIN_RESET;
+  } else if (port == &sim->resetPort && state == GPIO_PIN_RESET) {
+    _ENC28J60_simReset(sim);
+  }
+}
+
+/* The INT pin is low while an enabled flag is set */
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef* port, uint16_t pin) {
+  ENC28J60_Sim* sim = port->sim;
+  uint8_t eir = sim->common[EIR - EIE] | (sim->pendingPackets > 0 ? EIR_PKTIF : 0);
+  uint8_t eie = sim->common[EIE - EIE];
+
+  if ((eie & EIE_INTIE) != 0 && (eir & eie & 0x7f) != 0) {
+    return GPIO_PIN_RESET;
+  }
+  return GPIO_PIN_SET;
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef* spi, uint8_t* tx, uint8_t* rx, uint16_t len, uint32_t timeout) {
+  uint16_t i;
+
+  if (spi->sim->spiError) {
+    return HAL_ERROR;
+  }
+
+  for (i = 0; i < len; i++) {
+    rx[i] = _ENC28J60_simExchange(spi->sim, tx[i]);
+  }
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef* spi, uint8_t* tx, uint16_t len, uint32_t timeout) {
+  uint16_t i;
+
+  if (spi->sim->spiError) {
+    return HAL_ERROR;
+  }
+
+  for (i = 0; i < len; i++) {
+    _ENC28J60_simExchange(spi->sim, tx[i]);
+  }
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef* spi, uint8_t* rx, uint16_t len, uint32_t timeout) {
+  uint16_t i;
+
+  if (spi->sim->spiError) {
+    return HAL_ERROR;
+  }
+
+  for (i = 0; i < len; i++) {
+    rx[i] = _ENC28J60_simExchange(spi->sim, 0);
+  }
+  return HAL_OK;
+}
+
+/* DMA transfers are over by the time they are started */
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef* spi, uint8_t* tx, uint16_t len) {
+  spi->sim->dmaTransfers++;
+  spi->sim->dmaBytes += len;
+  return HAL_SPI_Transmit(spi, tx, len, 0);
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive_DMA(SPI_HandleTypeDef* spi, uint8_t* rx, uint16_t len) {
+  spi->sim->dmaTransfers++;
+  spi->sim->dmaBytes += len;
+  return HAL_SPI_Receive(spi, rx, len, 0);
+}
+
+HAL_SPI_StateTypeDef HAL_SPI_GetState(SPI_HandleTypeDef* spi) {
+  return HAL_SPI_STATE_READY;
+}
+
+uint8_t* _ENC28J60_simReg(ENC28J60_Sim* sim, uint8_t reg) {
+  if (reg >= EIE) {
+    return &sim->common[reg - EIE];
+  }
+  return &sim->banks[sim->common[ECON1 - EIE] & 0x03][reg];
+}
+
+uint16_t _ENC28J60_simReg16(ENC28J60_Sim* sim, uint8_t bank, uint8_t reg) {
+  return sim->banks[bank][reg] | (sim->banks[bank][reg + 1] << 8);
+}
+
+void _ENC28J60_simSetReg16(ENC28J60_Sim* sim, uint8_t bank, uint8_t reg, uint16_t value) {
+  sim->banks[bank][reg] = value & 0xff;
+  sim->banks[bank][reg + 1] = value >> 8;
+}
+
+/* These answer a read with a dummy byte first */
+uint8_t _ENC28J60_simIsMacMiiReg(ENC28J60_Sim* sim, uint8_t reg) {
+  switch (sim->common[ECON1 - EIE] & 0x03) {
+  case 2:
+    return reg < EIE;
+  case 3:
+    return reg <= 0x05 || reg == MISTAT;
+  default:
+    return 0;
+  }
+}
+
+uint8_t _ENC28J60_simReadReg(ENC28J60_Sim* sim, uint8_t reg) {
+  uint8_t bank = sim->common[ECON1 - EIE] & 0x03;
+
+  if (reg == EIR) {
+    return sim->common[EIR - EIE] | (sim->pendingPackets > 0 ? EIR_PKTIF : 0);
+  }
+  if (bank == 1 && reg == EPKTCNT) {
+    return sim->pendingPackets;
+  }
+  return *_ENC28J60_simReg(sim, reg);
+}
+
+void _ENC28J60_simWriteReg(ENC28J60_Sim* sim, uint8_t reg, uint8_t value) {
+  uint8_t bank = sim->common[ECON1 - EIE] & 0x03;
+
+  if (reg == ESTAT) {
+    return;
+  }
+  *_ENC28J60_simReg(sim, reg) = value;
+
+  if (reg == ECON1) {
+    if (value & ECON1_RXRST) {
+      sim->pendingPackets = 0;
+    }
+    if ((value & ECON1_TXRTS) && !sim->txHeld) {
+      _ENC28J60_simTransmit(sim);
+    }
+    if (value & ECON1_DMAST) {
+      _ENC28J60_simDmaCopy(sim);
+    }
+  } else if (reg == ECON2) {
+    if ((value & ECON2_PKTDEC) && sim->pendingPackets > 0) {
+      sim->pendingPackets--;
+    }
+    sim->common[ECON2 - EIE] &= ~ECON2_PKTDEC;
+  } else if (bank == 0 && (reg == ERXSTL || reg == ERXSTH)) {
+    /* Programming ERXST also moves the write pointer there */
+    sim->banks[0][ERXWRPTL] = sim->banks[0][ERXSTL];
+    sim->banks[0][ERXWRPTL + 1] = sim->banks[0][ERXSTH];
+  } else if (bank == 2 && reg == MICMD && (value & MICMD_MIIRD)) {
+    uint8_t address = sim->banks[2][MIREGADR] & 0x1f;
+    sim->banks[2][MIRDL] = sim->phy[address] & 0xff;
+    sim->banks[2][MIRDH] = sim->phy[address] >> 8;
+    /* Reading PHIR clears the link interrupt */
+    if (address == PHIR) {
+      sim->common[EIR - EIE] &= ~EIR_LINKIF;
+    }
+  } else if (bank == 2 && reg == MIWRH) {
+    sim->phy[sim->banks[2][MIREGADR] & 0x1f] = sim->banks[2][MIWRL] | (value << 8);
+  }
+}
+
+uint8_t _ENC28J60_simExchange(ENC28J60_Sim* sim, uint8_t in) {
+  uint16_t address;
+  uint8_t reg, out;
+
+  if (!sim->selected) {
+    return 0xff;
+  }
+  sim->bytes++;
+  if (sim->position++ == 0) {
+    sim->opcode = in;
+    if (sim->transactions - 1 < ENC28J60_SIM_LOG_SIZE) {
+      sim->commands[sim->transactions - 1] = in;
+    }
+    if (in == 0xff) {
+      _ENC28J60_simReset(sim);
+    }
+    return 0;
+  }
+
+  reg = sim->opcode & 0x1f;
+  switch (sim->opcode >> 5) {
+  case 0:
+    /* Read Control Register */
+    if (_ENC28J60_simIsMacMiiReg(sim, reg) && sim->position == 2) {
+      return 0;
+    }
+    return _ENC28J60_simReadReg(sim, reg);
+  case 1:
+    /* Read Buffer Memory, wrapping inside the receive ring */
+    address = _ENC28J60_simReg16(sim, 0, ERDPTL);
+    out = sim->memory[address % ENC28J60_SIM_MEMORY_SIZE];
+    if (sim->common[ECON2 - EIE] & ECON2_AUTOINC) {
+      if (address == _ENC28J60_simReg16(sim, 0, ERXNDL)) {
+        address = _ENC28J60_simReg16(sim, 0, ERXSTL);
+      } else {
+        address = (address + 1) % ENC28J60_SIM_MEMORY_SIZE;
+      }
+      _ENC28J60_simSetReg16(sim, 0, ERDPTL, address);
+    }
+    return out;
+  case 2:
+    /* Write Control Register */
+    if (sim->position == 2) {
+      _ENC28J60_simWriteReg(sim, reg, in);
+    }
+    return 0;
+  case 3:
+    /* Write Buffer Memory */
+    address = _ENC28J60_simReg16(sim, 0, EWRPTL);
+    sim->memory[address % ENC28J60_SIM_MEMORY_SIZE] = in;
+    if (sim->common[ECON2 - EIE] & ECON2_AUTOINC) {
+      _ENC28J60_simSetReg16(sim, 0, EWRPTL, (address + 1) % ENC28J60_SIM_MEMORY_SIZE);
+    }
+    return 0;
+  case 4:
+    /* Bit Field Set */
+    if (sim->position == 2) {
+      _ENC28J60_simWriteReg(sim, reg, *_ENC28J60_simReg(sim, reg) | in);
+    }
+    return 0;
+  case 5:
+    /* Bit Field Clear */
+    if (sim->position == 2) {
+      _ENC28J60_simWriteReg(sim, reg, *_ENC28J60_simReg(sim, reg) & ~in);
+    }
+    return 0;
+  default:
+    return 0;
+  }
+}
+
+/* Power-on values of what the driver relies on */
+void _ENC28J60_simReset(ENC28J60_Sim* sim) {
+  uint16_t phstat2 = sim->phy[PHSTAT2] & PHSTAT2_LSTAT;
+
+  memset(sim->banks, 0, sizeof(sim->banks));
+  memset(sim->common, 0, sizeof(sim->common));
+  memset(sim->phy, 0, sizeof(sim->phy));
+  sim->common[ESTAT - EIE] = ESTAT_CLKRDY;
+  sim->common[ECON2 - EIE] = ECON2_AUTOINC;
+  _ENC28J60_simSetReg16(sim, 0, ERXSTL, 0x05fa);
+  _ENC28J60_simSetReg16(sim, 0, ERXNDL, 0x1fff);
+  _ENC28J60_simSetReg16(sim, 0, ERXWRPTL, 0x05fa);
+  _ENC28J60_simSetReg16(sim, 0, ERXRDPTL, 0x05fa);
+  sim->banks[3][EREVID] = 0x06;
+  sim->phy[PHSTAT2] = phstat2;
+  sim->pendingPackets = 0;
+}
+
+/* The frame goes from ETXST + 1, after the control byte, to ETXND and
+   is followed by its status vector */
+void _ENC28J60_simTransmit(ENC28J60_Sim* sim) {
+  uint16_t start = _ENC28J60_simReg16(sim, 0, ETXSTL);
+  uint16_t end = _ENC28J60_simReg16(sim, 0, ETXNDL);
+  uint8_t tsv[TSV_LENGTH];
+  uint16_t i;
+
+  sim->txLength = end - start;
+  if (sim->txLength > sizeof(sim->txFrame)) {
+    sim->txLength = sizeof(sim->txFrame);
+  }
+  memcpy(sim->txFrame, sim->memory + start + 1, sim->txLength);
+  sim->txFrames++;
+
+  memset(tsv, 0, sizeof(tsv));
+  tsv[0] = sim->txLength & 0xff;
+  tsv[1] = sim->txLength >> 8;
+  /* Transmit done */
+  tsv[2] = 0x80;
+  for (i = 0; i < TSV_LENGTH; i++) {
+    sim->memory[(end + 1 + i) % ENC28J60_SIM_MEMORY_SIZE] = tsv[i];
+  }
+
+  sim->common[ECON1 - EIE] &= ~ECON1_TXRTS;
+  sim->common[EIR - EIE] |= EIR_TXIF;
+}
+
+/* The copy wraps inside the receive ring like the chip's */
+void _ENC28J60_simDmaCopy(ENC28J60_Sim* sim) {
+  uint16_t source = _ENC28J60_simReg16(sim, 0, EDMASTL);
+  uint16_t end = _ENC28J60_simReg16(sim, 0, EDMANDL);
+  uint16_t destination = _ENC28J60_simReg16(sim, 0, EDMADSTL);
+
+  for (;;) {
+    sim->memory[destination % ENC28J60_SIM_MEMORY_SIZE] = sim->memory[source];
+    destination++;
+    if (source == end) {
+      break;
+    }
+    source = _ENC28J60_simRingNext(sim, source);
+  }
+  sim->common[ECON1 - EIE] &= ~ECON1_DMAST;
+  sim->common[EIR - EIE] |= EIR_DMAIF;
+}
+
+uint16_t _ENC28J60_simRingNext(ENC28J60_Sim* sim, uint16_t address) {
+  if (address == _ENC28J60_simReg16(sim, 0, ERXNDL)) {
+    return _ENC28J60_simReg16(sim, 0, ERXSTL);
+  }
+  return (address + 1) % ENC28J60_SIM_MEMORY_SIZE;
+}
@@ -0,0 +1,67 @@
+
+#ifndef _enc28j60_sim_h_
+#define _enc28j60_sim_h_
+
+#include "enc28j60.h"
+
+/* A simulated ENC28J60 behind the host HAL: the SPI opcodes, the three
+   register banks the driver uses, buffer memory with the receive ring,
+   PHY registers through the MII interface, transmission and the DMA
+   copy. Frames are sent the moment TXRTS is set. Every transaction is
+   recorded so tests can hold an operation to its SPI budget. */
+
+#define ENC28J60_SIM_MEMORY_SIZE 0x2000
+#define ENC28J60_SIM_LOG_SIZE    256
+
+typedef struct ENC28J60_Sim {
+  SPI_HandleTypeDef spi;
+  GPIO_TypeDef csPort;
+  GPIO_TypeDef resetPort;
+  GPIO_TypeDef intPort;
+
+  uint8_t banks[4][0x1b];
+  uint8_t common[5];
+  uint16_t phy[0x20];
+  uint8_t memory[ENC28J60_SIM_MEMORY_SIZE];
+  uint8_t pendingPackets;
+
+  uint8_t selected;
+  uint16_t position;
+  uint8_t opcode;
+
+  /* While set, a frame waits on TXRTS for ENC28J60_simReleaseTx */
+  uint8_t txHeld;
+  /* While set, every SPI transfer fails without reaching the chip */
+  uint8_t spiError;
+
+  /* The last frame sent */
+  uint32_t txFrames;
+  uint16_t txLength;
+  uint8_t txFrame[ENC28J60_MAX_FRAME_LENGTH];
+
+  /* Since ENC28J60_simClearLog. commands holds the opcode of each of the
+     first ENC28J60_SIM_LOG_SIZE transactions. */
+  uint32_t transactions;
+  uint32_t bytes;
+  uint32_t dmaTransfers;
+  uint32_t dmaBytes;
+  uint8_t commands[ENC28J60_SIM_LOG_SIZE];
+} ENC28J60_Sim;
+
+void ENC28J60_simSetup(ENC28J60_Sim* sim);
+
+/* Points the driver's SPI and GPIO handles at the simulated chip */
+void ENC28J60_simAttach(ENC28J60_Sim* sim, ENC28J60* enc28j60);
+
+/* Puts a frame in the receive ring as the chip would, the CRC is added.
+   Returns 0 if it didn't fit or reception is off. */
+int ENC28J60_simReceive(ENC28J60_Sim* sim, const uint8_t* data, uint16_t len);
+void ENC28J60_simSetLink(ENC28J60_Sim* sim, uint8_t up);
+void ENC28J60_simHoldTx(ENC28J60_Sim* sim);
+void ENC28J60_simReleaseTx(ENC28J60_Sim* sim);
+void ENC28J60_simClearLog(ENC28J60_Sim* sim);
+
+/* The HAL_GetTick clock, in milliseconds */
+void ENC28J60_simAdvance(uint32_t ms);
+
+#endif
@@ -0,0 +1,50 @@
+
+#ifndef _platform_config_h_
+#define _platform_config_h_
+
+/* Host stand-in for the STM32 HAL, for the tests only. SPI and GPIO
+   handles lead to the simulated chip behind them. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef enum {
+  HAL_OK = 0,
+  HAL_ERROR,
+  HAL_BUSY,
+  HAL_TIMEOUT
+} HAL_StatusTypeDef;
+
+typedef enum {
+  HAL_SPI_STATE_RESET = 0,
+  HAL_SPI_STATE_READY,
+  HAL_SPI_STATE_BUSY
+} HAL_SPI_StateTypeDef;
+
+typedef enum {
+  GPIO_PIN_RESET = 0,
+  GPIO_PIN_SET
+} GPIO_PinState;
+
+struct ENC28J60_Sim;
+
+typedef struct {
+  struct ENC28J60_Sim* sim;
+} SPI_HandleTypeDef;
+
+typedef struct {
+  struct ENC28J60_Sim* sim;
+} GPIO_TypeDef;
+
+uint32_t HAL_GetTick(void);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive(SPI_HandleTypeDef* spi, uint8_t* tx, uint8_t* rx, uint16_t len, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef* spi, uint8_t* tx, uint16_t len, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef* spi, uint8_t* rx, uint16_t len, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef* spi, uint8_t* tx, uint16_t len);
+HAL_StatusTypeDef HAL_SPI_Receive_DMA(SPI_HandleTypeDef* spi, uint8_t* rx, uint16_t len);
+HAL_SPI_StateTypeDef HAL_SPI_GetState(SPI_HandleTypeDef* spi);
+void HAL_GPIO_WritePin(GPIO_TypeDef* port, uint16_t pin, GPIO_PinState state);
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef* port, uint16_t pin);
+
+#endif
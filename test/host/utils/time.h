@@ -0,0 +1,11 @@
+
+#ifndef _utils_time_h_
+#define _utils_time_h_
+
+#include <stdint.h>
+
+/* Host stand-in, the simulated clock just moves on */
+void sleep_ms(uint32_t ms);
+void sleep_us(uint32_t us);
+
+#endif
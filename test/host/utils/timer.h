@@ -0,0 +1,16 @@
+
+#ifndef _utils_timer_h_
+#define _utils_timer_h_
+
+#include <stdint.h>
+
+/* Host stand-in, periods are in HAL_GetTick milliseconds */
+typedef struct {
+  uint32_t period;
+  uint32_t last;
+} PeriodicTimer;
+
+void periodicTimer_setup(PeriodicTimer* timer, uint32_t period);
+int periodicTimer_hasElapsed(PeriodicTimer* timer);
+
+#endif
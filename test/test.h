@@ -0,0 +1,17 @@
+
+#ifndef _test_h_
+#define _test_h_
+
+#include <stdio.h>
+
+/* Counts failures for main to return, and carries on */
+extern int testFailures;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      testFailures++; \
+    } \
+  } while (0)
+
+#endif
@@ -0,0 +1,58 @@
+#include "enc28j60_sim.h"
+#include "test.h"
+#include <string.h>
+
+/* Frame reads take DMA for the whole cache lines of the buffer they
+   cover, whatever the frame length and buffer alignment */
+
+int testFailures;
+
+static ENC28J60_Sim sim;
+static ENC28J60 enc28j60;
+static ENC28J60_DMA_BUFFER(buffer, ENC28J60_MAX_FRAME_LENGTH + ENC28J60_CACHE_LINE);
+
+static void testRead(uint16_t len, uint16_t misalignment) {
+  uint8_t frame[ENC28J60_MAX_FRAME_LENGTH];
+  uint8_t* destination = buffer + misalignment;
+  uint16_t head, lines, i;
+  int received;
+
+  for (i = 0; i < len; i++) {
+    frame[i] = (uint8_t) (i * 7 + len);
+  }
+  /* Unicast, the chip would not let other multicast in */
+  frame[0] &= ~0x01;
+  CHECK(ENC28J60_simReceive(&sim, frame, len));
+
+  ENC28J60_simClearLog(&sim);
+  received = ENC28J60_receive(&enc28j60, destination, ENC28J60_MAX_FRAME_LENGTH);
+
+  /* The chip's count includes the CRC */
+  CHECK(received == len + 4);
+  CHECK(memcmp(destination, frame, len) == 0);
+
+  head = (ENC28J60_CACHE_LINE - misalignment % ENC28J60_CACHE_LINE) % ENC28J60_CACHE_LINE;
+  lines = (received - head) / ENC28J60_CACHE_LINE;
+  CHECK(sim.dmaTransfers == 1);
+  CHECK(sim.dmaBytes == lines * ENC28J60_CACHE_LINE);
+}
+
+int main(void) {
+  static const uint8_t macAddress[MAC_ADDRESS_LENGTH] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+
+  ENC28J60_simSetup(&sim);
+  memset(&enc28j60, 0, sizeof(enc28j60));
+  ENC28J60_simAttach(&sim, &enc28j60);
+  memcpy(enc28j60.macAddress, macAddress, MAC_ADDRESS_LENGTH);
+  ENC28J60_setup(&enc28j60);
+
+  testRead(301, 3);
+  testRead(301, 0);
+  testRead(64, 17);
+  testRead(1514, 1);
+
+  if (testFailures == 0) {
+    printf("test_dma: ok\n");
+  }
+  return testFailures != 0;
+}
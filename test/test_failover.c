@@ -0,0 +1,91 @@
+#include "enc28j60_sim.h"
+#include "enc28j60_failover.h"
+#include "test.h"
+#include <string.h>
+
+/* The standby is left alone by the tick, and a switch that can't move
+   the addresses leaves everything on the active interface */
+
+int testFailures;
+
+static ENC28J60_Sim sims[2];
+static ENC28J60 chips[2];
+static ENC28J60_Failover failover;
+static uint8_t frame[60];
+
+static const uint8_t macAddresses[2][MAC_ADDRESS_LENGTH] = {
+  { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 },
+  { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 }
+};
+static const uint8_t ipAddress[ENC28J60_IPV4_ADDRESS_LENGTH] = { 192, 168, 0, 2 };
+
+/* An idle standby is never taken for hung */
+static void testStandbyTick(void) {
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    ENC28J60_simAdvance(ENC28J60_WATCHDOG_PERIOD);
+    ENC28J60_failoverTick(&failover);
+  }
+  CHECK(failover.active == 0);
+  CHECK(failover.standbyUsable);
+  CHECK(chips[1].recoveryStats.watchdogResets == 0);
+}
+
+static void testFailedSwitch(void) {
+  uint32_t txFrames;
+
+  /* Something queued behind a frame in flight */
+  ENC28J60_simHoldTx(&sims[0]);
+  CHECK(ENC28J60_queue(&chips[0], ENC28J60_TX_BULK, frame, sizeof(frame)) == HAL_OK);
+  CHECK(ENC28J60_queue(&chips[0], ENC28J60_TX_BULK, frame, sizeof(frame)) == HAL_OK);
+  CHECK(ENC28J60_txQueueDepth(&chips[0], ENC28J60_TX_BULK) == 1);
+
+  sims[1].spiError = 1;
+  CHECK(ENC28J60_failoverSwitch(&failover) != HAL_OK);
+  sims[1].spiError = 0;
+
+  CHECK(failover.active == 0);
+  CHECK(failover.switches == 0);
+  CHECK(memcmp(chips[0].macAddress, macAddresses[0], MAC_ADDRESS_LENGTH) == 0);
+  CHECK(memcmp(chips[1].macAddress, macAddresses[1], MAC_ADDRESS_LENGTH) == 0);
+  CHECK(ENC28J60_txQueueDepth(&chips[0], ENC28J60_TX_BULK) == 1);
+
+  /* And the next attempt goes through */
+  txFrames = sims[1].txFrames;
+  CHECK(ENC28J60_failoverSwitch(&failover) == HAL_OK);
+  CHECK(failover.active == 1);
+  CHECK(failover.switches == 1);
+  CHECK(memcmp(chips[1].macAddress, macAddresses[0], MAC_ADDRESS_LENGTH) == 0);
+  CHECK(memcmp(chips[0].macAddress, macAddresses[1], MAC_ADDRESS_LENGTH) == 0);
+  CHECK(ENC28J60_txQueueDepth(&chips[0], ENC28J60_TX_BULK) == 0);
+  /* The gratuitous ARP */
+  CHECK(sims[1].txFrames == txFrames + 1);
+  ENC28J60_simReleaseTx(&sims[0]);
+
+  /* The new active's watchdog starts a fresh period */
+  ENC28J60_failoverTick(&failover);
+  CHECK(chips[1].recoveryStats.watchdogResets == 0);
+}
+
+int main(void) {
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    ENC28J60_simSetup(&sims[i]);
+    ENC28J60_simSetLink(&sims[i], 1);
+    memset(&chips[i], 0, sizeof(chips[i]));
+    ENC28J60_simAttach(&sims[i], &chips[i]);
+    memcpy(chips[i].macAddress, macAddresses[i], MAC_ADDRESS_LENGTH);
+    ENC28J60_setup(&chips[i]);
+  }
+  ENC28J60_failoverSetup(&failover, &chips[0], &chips[1], ipAddress);
+
+  testStandbyTick();
+  testFailedSwitch();
+
+  if (testFailures == 0) {
+    printf("test_failover: ok\n");
+  }
+  return testFailures != 0;
+}
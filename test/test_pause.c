@@ -0,0 +1,77 @@
+#include "enc28j60_sim.h"
+#include "test.h"
+#include <string.h>
+
+/* In full duplex a stuck transmitter times out after the frame's wire
+   time and margin, until a peer's PAUSE frame asks for longer */
+
+int testFailures;
+
+static ENC28J60_Sim sim;
+static ENC28J60 enc28j60;
+static uint8_t frame[100];
+
+/* Starts a frame the chip never finishes, and polls it after ms */
+static void holdFrame(uint32_t ms) {
+  ENC28J60_simHoldTx(&sim);
+  CHECK(ENC28J60_queue(&enc28j60, ENC28J60_TX_BULK, frame, sizeof(frame)) == HAL_OK);
+  ENC28J60_simAdvance(ms);
+  ENC28J60_serviceTx(&enc28j60);
+}
+
+static void receivePause(uint16_t quanta) {
+  static const uint8_t pause[16] = {
+    0x01, 0x80, 0xc2, 0x00, 0x00, 0x01,
+    0x02, 0x00, 0x00, 0x00, 0x00, 0x09,
+    0x88, 0x08, 0x00, 0x01
+  };
+  uint8_t data[60];
+  uint8_t buffer[ENC28J60_MAX_FRAME_LENGTH];
+
+  memset(data, 0, sizeof(data));
+  memcpy(data, pause, sizeof(pause));
+  data[16] = quanta >> 8;
+  data[17] = quanta & 0xff;
+  CHECK(ENC28J60_simReceive(&sim, data, sizeof(data)));
+  /* Consumed, not delivered */
+  CHECK(ENC28J60_receive(&enc28j60, buffer, sizeof(buffer)) == 0);
+  CHECK(sim.pendingPackets == 0);
+}
+
+int main(void) {
+  static const uint8_t macAddress[MAC_ADDRESS_LENGTH] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+
+  ENC28J60_simSetup(&sim);
+  memset(&enc28j60, 0, sizeof(enc28j60));
+  ENC28J60_simAttach(&sim, &enc28j60);
+  memcpy(enc28j60.macAddress, macAddress, MAC_ADDRESS_LENGTH);
+  ENC28J60_setup(&enc28j60);
+  memset(frame, 0x5a, sizeof(frame));
+
+  /* No pause seen, no allowance */
+  holdFrame(10);
+  CHECK(enc28j60.txStats.timeouts == 1);
+
+  receivePause(0xffff);
+  CHECK(enc28j60.rxStats.pauseFrames == 1);
+  CHECK(enc28j60.txPauseAllowance == 3355392);
+
+  /* Now held up to the pause asked for */
+  holdFrame(10);
+  CHECK(enc28j60.txStats.timeouts == 1);
+  ENC28J60_simAdvance(3400);
+  ENC28J60_serviceTx(&enc28j60);
+  CHECK(enc28j60.txStats.timeouts == 2);
+
+  /* A shorter pause doesn't lower it, half duplex drops it */
+  receivePause(100);
+  CHECK(enc28j60.rxStats.pauseFrames == 2);
+  CHECK(enc28j60.txPauseAllowance == 3355392);
+  CHECK(ENC28J60_setMacTiming(&enc28j60, &ENC28J60_MAC_TIMING_STANDARD) == HAL_OK);
+  CHECK(enc28j60.txPauseAllowance == 0);
+
+  if (testFailures == 0) {
+    printf("test_pause: ok\n");
+  }
+  return testFailures != 0;
+}
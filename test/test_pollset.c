@@ -0,0 +1,70 @@
+#include "enc28j60_sim.h"
+#include "enc28j60_pollset.h"
+#include "test.h"
+#include <string.h>
+
+/* Ports of a poll set share transmitting by bytes: one sending short
+   frames gets as much out as one sending long frames. Built with a
+   transmit quantum below a full frame. */
+
+int testFailures;
+
+#define ROUNDS 30
+#define SHORT_LENGTH 300
+#define LONG_LENGTH 1500
+
+static ENC28J60_Sim sims[2];
+static ENC28J60 chips[2];
+static ENC28J60_PollSet set;
+static uint8_t buffer[ENC28J60_MAX_FRAME_LENGTH];
+static uint8_t frame[LONG_LENGTH];
+
+static void handler(void* context, uint8_t port, const uint8_t* data, uint16_t length) {
+}
+
+/* The chip holds on to the first frame, so the rest stay queued */
+static void refill(ENC28J60_Sim* sim, ENC28J60* enc28j60, uint16_t length) {
+  ENC28J60_simHoldTx(sim);
+  while (ENC28J60_txQueueDepth(enc28j60, ENC28J60_TX_BULK) < ENC28J60_TX_QUEUE_DEPTH) {
+    CHECK(ENC28J60_queue(enc28j60, ENC28J60_TX_BULK, frame, length) == HAL_OK);
+  }
+  ENC28J60_simReleaseTx(sim);
+}
+
+int main(void) {
+  static const uint8_t macAddress[MAC_ADDRESS_LENGTH] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+  uint32_t shortBytes, longBytes, difference;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    ENC28J60_simSetup(&sims[i]);
+    memset(&chips[i], 0, sizeof(chips[i]));
+    ENC28J60_simAttach(&sims[i], &chips[i]);
+    memcpy(chips[i].macAddress, macAddress, MAC_ADDRESS_LENGTH);
+    ENC28J60_setup(&chips[i]);
+  }
+
+  ENC28J60_pollSetSetup(&set, buffer, sizeof(buffer), handler, NULL);
+  CHECK(ENC28J60_pollSetAdd(&set, &chips[0], NULL, 0) == 0);
+  CHECK(ENC28J60_pollSetAdd(&set, &chips[1], NULL, 0) == 1);
+
+  /* Queue before each round, so neither port runs dry */
+  for (i = 0; i < ROUNDS; i++) {
+    refill(&sims[0], &chips[0], SHORT_LENGTH);
+    refill(&sims[1], &chips[1], LONG_LENGTH);
+    ENC28J60_pollSetRun(&set);
+  }
+
+  shortBytes = set.ports[0].txBytes;
+  longBytes = set.ports[1].txBytes;
+  CHECK(shortBytes >= ROUNDS * ENC28J60_POLLSET_TX_QUANTUM - LONG_LENGTH);
+  difference = shortBytes > longBytes ? shortBytes - longBytes : longBytes - shortBytes;
+  CHECK(difference <= LONG_LENGTH);
+
+  if (testFailures == 0) {
+    printf("test_pollset: ok\n");
+  } else {
+    printf("short port %lu bytes, long port %lu bytes\n", (unsigned long) shortBytes, (unsigned long) longBytes);
+  }
+  return testFailures != 0;
+}
@@ -0,0 +1,100 @@
+#include "enc28j60_sim.h"
+#include "test.h"
+#include <string.h>
+
+/* A frame from ENC28J60_sendAt goes out at its deadline with a single SPI
+   command, also when another frame was sent in the meantime */
+
+int testFailures;
+
+static ENC28J60_Sim sim;
+static ENC28J60 enc28j60;
+static uint8_t tapBuffer[ENC28J60_MAX_FRAME_LENGTH];
+static uint8_t tapped[ENC28J60_MAX_FRAME_LENGTH];
+static uint16_t tappedLength;
+static uint32_t taps;
+
+/* Bit field set on ECON1 */
+#define SET_ECON1 0x9f
+
+static void fill(uint8_t* frame, uint16_t len, uint8_t seed) {
+  uint16_t i;
+
+  for (i = 0; i < len; i++) {
+    frame[i] = (uint8_t) (i + seed);
+  }
+}
+
+static void testLaunch(uint8_t sendBetween) {
+  uint8_t scheduled[200];
+  uint8_t other[64];
+  uint32_t txFrames;
+
+  fill(scheduled, sizeof(scheduled), 1);
+  CHECK(ENC28J60_sendAt(&enc28j60, scheduled, sizeof(scheduled), ENC28J60_MICROS() + 100000) == HAL_OK);
+  CHECK(ENC28J60_pollScheduled(&enc28j60) == HAL_BUSY);
+
+  if (sendBetween) {
+    fill(other, sizeof(other), 2);
+    CHECK(ENC28J60_send(&enc28j60, other, sizeof(other)) == sizeof(other));
+  }
+
+  txFrames = sim.txFrames;
+  ENC28J60_simAdvance(200);
+  ENC28J60_simClearLog(&sim);
+  CHECK(ENC28J60_pollScheduled(&enc28j60) == HAL_OK);
+  CHECK(sim.transactions == 1);
+  CHECK(sim.commands[0] == SET_ECON1);
+  CHECK(sim.txFrames == txFrames + 1);
+  CHECK(sim.txLength == sizeof(scheduled));
+  CHECK(memcmp(sim.txFrame, scheduled, sizeof(scheduled)) == 0);
+
+  /* Collects it, so the slot can take the next one */
+  ENC28J60_serviceTx(&enc28j60);
+}
+
+static void tap(void* context, uint8_t direction, const uint8_t* data, uint16_t length) {
+  memcpy(tapped, data, length);
+  tappedLength = length;
+  taps++;
+}
+
+/* The tap sees the frame when it goes, read back from chip memory */
+static void testTap(void) {
+  uint8_t scheduled[100];
+
+  ENC28J60_setFrameTap(&enc28j60, tap, NULL);
+  ENC28J60_setFrameTapBuffer(&enc28j60, tapBuffer, sizeof(tapBuffer));
+
+  fill(scheduled, sizeof(scheduled), 3);
+  CHECK(ENC28J60_sendAt(&enc28j60, scheduled, sizeof(scheduled), ENC28J60_MICROS() + 100000) == HAL_OK);
+  CHECK(taps == 0);
+
+  ENC28J60_simAdvance(200);
+  CHECK(ENC28J60_pollScheduled(&enc28j60) == HAL_OK);
+  CHECK(taps == 1);
+  CHECK(tappedLength == sizeof(scheduled));
+  CHECK(memcmp(tapped, scheduled, sizeof(scheduled)) == 0);
+
+  ENC28J60_serviceTx(&enc28j60);
+  ENC28J60_setFrameTap(&enc28j60, NULL, NULL);
+}
+
+int main(void) {
+  static const uint8_t macAddress[MAC_ADDRESS_LENGTH] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+
+  ENC28J60_simSetup(&sim);
+  memset(&enc28j60, 0, sizeof(enc28j60));
+  ENC28J60_simAttach(&sim, &enc28j60);
+  memcpy(enc28j60.macAddress, macAddress, MAC_ADDRESS_LENGTH);
+  ENC28J60_setup(&enc28j60);
+
+  testLaunch(0);
+  testLaunch(1);
+  testTap();
+
+  if (testFailures == 0) {
+    printf("test_scheduled: ok\n");
+  }
+  return testFailures != 0;
+}
@@ -0,0 +1,185 @@
+#include "enc28j60_sim.h"
+#include "test.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Holds each operation to its SPI budget: the transactions, the bytes
+   clocked and the command opening each transaction are compared with the
+   golden file. After a change that is meant to alter them, regenerate it
+   with make -C test golden and review the diff. */
+
+int testFailures;
+
+static ENC28J60_Sim sim;
+static ENC28J60 enc28j60;
+static uint8_t frame[ENC28J60_MAX_FRAME_LENGTH];
+static uint8_t buffer[ENC28J60_MAX_FRAME_LENGTH];
+
+static char golden[64 * 1024];
+static char result[64 * 1024];
+static size_t resultLength;
+
+static void begin(void) {
+  ENC28J60_simClearLog(&sim);
+  memset(&enc28j60.spiStats, 0, sizeof(enc28j60.spiStats));
+}
+
+/* Records one line: name, transactions, bytes, then the commands */
+static void record(const char* name) {
+  uint32_t i;
+
+  /* The driver's own counter must agree with the bus */
+  CHECK(enc28j60.spiStats.transactions == sim.transactions);
+
+  resultLength += snprintf(result + resultLength, sizeof(result) - resultLength,
+                           "%s %lu %lu:", name, (unsigned long) sim.transactions, (unsigned long) sim.bytes);
+  for (i = 0; i < sim.transactions && i < ENC28J60_SIM_LOG_SIZE; i++) {
+    resultLength += snprintf(result + resultLength, sizeof(result) - resultLength, " %02x", sim.commands[i]);
+  }
+  resultLength += snprintf(result + resultLength, sizeof(result) - resultLength, "\n");
+}
+
+static void fill(uint16_t len) {
+  uint16_t i;
+
+  for (i = 0; i < len; i++) {
+    frame[i] = (uint8_t) (i * 3 + len);
+  }
+}
+
+/* Frame sizes are on the wire, the 4 CRC bytes included */
+static void run(void) {
+  begin();
+  CHECK(ENC28J60_receive(&enc28j60, buffer, sizeof(buffer)) == 0);
+  record("receive-empty");
+
+  fill(60);
+  CHECK(ENC28J60_simReceive(&sim, frame, 60));
+  begin();
+  CHECK(ENC28J60_receive(&enc28j60, buffer, sizeof(buffer)) == 64);
+  record("receive-64");
+
+  fill(1514);
+  CHECK(ENC28J60_simReceive(&sim, frame, 1514));
+  begin();
+  CHECK(ENC28J60_receive(&enc28j60, buffer, sizeof(buffer)) == 1518);
+  record("receive-1518");
+
+  /* Too long for the buffer, dropped from the ring */
+  CHECK(ENC28J60_simReceive(&sim, frame, 1514));
+  begin();
+  CHECK(ENC28J60_receive(&enc28j60, buffer, 64) == 0);
+  CHECK(sim.pendingPackets == 0);
+  record("receive-oversize");
+
+  fill(60);
+  begin();
+  CHECK(ENC28J60_send(&enc28j60, frame, 60) == 60);
+  CHECK(sim.txLength == 60);
+  record("send-64");
+
+  /* Refused before the chip is touched */
+  begin();
+  CHECK(ENC28J60_send(&enc28j60, frame, ENC28J60_MAX_TX_LENGTH + 1) == 0);
+  record("send-oversize");
+
+  begin();
+  ENC28J60_tick(&enc28j60);
+  record("tick");
+
+  /* A quiet watchdog period resets the chip */
+  ENC28J60_simAdvance(ENC28J60_WATCHDOG_PERIOD);
+  ENC28J60_tick(&enc28j60);
+  ENC28J60_simAdvance(ENC28J60_WATCHDOG_PERIOD);
+  begin();
+  ENC28J60_tick(&enc28j60);
+  CHECK(enc28j60.recoveryStats.watchdogResets == 1);
+  record("tick-reset");
+}
+
+static int readGolden(const char* path) {
+  FILE* file = fopen(path, "r");
+  size_t length;
+
+  if (file == NULL) {
+    printf("%s: cannot read\n", path);
+    return 0;
+  }
+  length = fread(golden, 1, sizeof(golden) - 1, file);
+  golden[length] = '\0';
+  fclose(file);
+  return 1;
+}
+
+static int writeGolden(const char* path) {
+  FILE* file = fopen(path, "w");
+
+  if (file == NULL) {
+    printf("%s: cannot write\n", path);
+    return 0;
+  }
+  fputs("# operation transactions bytes: command of each transaction\n", file);
+  fputs(result, file);
+  fclose(file);
+  return 1;
+}
+
+/* Compares line by line, skipping the golden file's comments */
+static void compare(void) {
+  char* expected = golden;
+  char* got = result;
+  char* expectedEnd;
+  char* gotEnd;
+
+  for (;;) {
+    while (*expected == '#') {
+      expected = strchr(expected, '\n');
+      expected = expected ? expected + 1 : golden + strlen(golden);
+    }
+    if (*expected == '\0' && *got == '\0') {
+      return;
+    }
+    expectedEnd = strchr(expected, '\n');
+    gotEnd = strchr(got, '\n');
+    if (expectedEnd == NULL || gotEnd == NULL || expectedEnd - expected != gotEnd - got ||
+        memcmp(expected, got, gotEnd - got) != 0) {
+      printf("spi budget changed\n  expected: %.*s\n  got:      %.*s\n",
+             expectedEnd ? (int) (expectedEnd - expected) : (int) strlen(expected), expected,
+             gotEnd ? (int) (gotEnd - got) : (int) strlen(got), got);
+      testFailures++;
+      return;
+    }
+    expected = expectedEnd + 1;
+    got = gotEnd + 1;
+  }
+}
+
+int main(int argc, char** argv) {
+  static const uint8_t macAddress[MAC_ADDRESS_LENGTH] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+  int update = argc == 3 && strcmp(argv[1], "-u") == 0;
+
+  if (argc != 2 && !update) {
+    printf("usage: test_spi_budget [-u] golden-file\n");
+    return 2;
+  }
+
+  ENC28J60_simSetup(&sim);
+  memset(&enc28j60, 0, sizeof(enc28j60));
+  ENC28J60_simAttach(&sim, &enc28j60);
+  memcpy(enc28j60.macAddress, macAddress, MAC_ADDRESS_LENGTH);
+  ENC28J60_setup(&enc28j60);
+
+  run();
+
+  if (update) {
+    return !writeGolden(argv[2]) || testFailures != 0;
+  }
+  if (!readGolden(argv[1])) {
+    return 1;
+  }
+  compare();
+  if (testFailures == 0) {
+    printf("test_spi_budget: ok\n");
+  }
+  return testFailures != 0;
+}